@@ -0,0 +1,305 @@
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// [comment]
+// OBJ parser for large meshes, producing indexed arrays instead of objl::Loader's
+// de-indexed vertices. The file is memory mapped and cut into chunks at line
+// boundaries, which are parsed in parallel in two passes: the first counts the
+// vertices and triangles of every chunk, so that the second can write them straight to
+// their place in the output. Numbers are read in place with std::from_chars; no
+// string is allocated per line or token. Only v, vt, vn and f lines are read (polygons
+// are split into triangle fans), everything else, groups and materials included, is
+// skipped.
+// [/comment]
+namespace objp
+{
+
+struct Mesh
+{
+    std::vector<float> positions;  // 3 per vertex
+    std::vector<float> normals;    // 3 per vertex, empty if the file has none
+    std::vector<float> texcoords;  // 2 per vertex, empty if the file has none
+    std::vector<uint32_t> indices; // 3 per triangle
+};
+
+namespace detail
+{
+
+// Position, texture coordinate and normal indices of a face corner (0-based, -1 if absent)
+struct Corner
+{
+    int64_t v, vt, vn;
+    bool operator==(const Corner& c) const { return v == c.v && vt == c.vt && vn == c.vn; }
+};
+
+struct CornerHash
+{
+    size_t operator()(const Corner& c) const
+    {
+        return size_t(c.v) * 73856093u ^ size_t(c.vt) * 19349663u ^ size_t(c.vn) * 83492791u;
+    }
+};
+
+struct Counts
+{
+    int64_t v = 0, vt = 0, vn = 0, triangles = 0;
+};
+
+inline const char* skipSpace(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        ++p;
+    return p;
+}
+
+inline const char* skipLine(const char* p, const char* end)
+{
+    while (p < end && *p != '\n')
+        ++p;
+    return p < end ? p + 1 : p;
+}
+
+inline const char* parseFloat(const char* p, const char* end, float& x)
+{
+    p = skipSpace(p, end);
+    if (p < end && *p == '+')
+        ++p;
+    x = 0;
+    return std::from_chars(p, end, x).ptr;
+}
+
+// OBJ indices are 1-based, or relative to the end of the list read so far if negative
+inline const char* parseIndex(const char* p, const char* end, int64_t count, int64_t& index)
+{
+    int64_t i = 0;
+    p = std::from_chars(p, end, i).ptr;
+    index = i > 0 ? i - 1 : i < 0 ? count + i : -1;
+    return p;
+}
+
+// Number of corners of the face whose indices start at p
+inline int countCorners(const char* p, const char* end)
+{
+    int n = 0;
+    for (p = skipSpace(p, end); p < end && *p != '\n'; p = skipSpace(p, end)) {
+        ++n;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+            ++p;
+    }
+    return n;
+}
+
+// [comment]
+// Parses the lines in [p, end). With out == nullptr only counts them; otherwise writes
+// them to out, starting at the offsets in first (the counts of all previous chunks).
+// [/comment]
+inline Counts parseChunk(const char* p, const char* end, const Counts& first, std::vector<float>* out,
+                         std::vector<Corner>* corners)
+{
+    Counts n;
+    while (p < end) {
+        p = skipSpace(p, end);
+        if (p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            if (out) {
+                float* v = &out[0][3 * (first.v + n.v)];
+                p = parseFloat(parseFloat(parseFloat(p + 1, end, v[0]), end, v[1]), end, v[2]);
+            }
+            ++n.v;
+        }
+        else if (p + 2 < end && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+            if (out) {
+                float* vt = &out[1][2 * (first.vt + n.vt)];
+                p = parseFloat(parseFloat(p + 2, end, vt[0]), end, vt[1]);
+            }
+            ++n.vt;
+        }
+        else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+            if (out) {
+                float* vn = &out[2][3 * (first.vn + n.vn)];
+                p = parseFloat(parseFloat(parseFloat(p + 2, end, vn[0]), end, vn[1]), end, vn[2]);
+            }
+            ++n.vn;
+        }
+        else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            int count = countCorners(p + 1, end);
+            if (out && count >= 3) {
+                Corner* c = &(*corners)[3 * (first.triangles + n.triangles)];
+                Corner firstCorner = {}, previous = {};
+                p = skipSpace(p + 1, end);
+                for (int k = 0; k < count; ++k, p = skipSpace(p, end)) {
+                    Corner corner;
+                    p = parseIndex(p, end, first.v + n.v, corner.v);
+                    corner.vt = corner.vn = -1;
+                    if (p < end && *p == '/') {
+                        if (p + 1 < end && p[1] != '/')
+                            p = parseIndex(p + 1, end, first.vt + n.vt, corner.vt);
+                        else
+                            ++p;
+                        if (p < end && *p == '/')
+                            p = parseIndex(p + 1, end, first.vn + n.vn, corner.vn);
+                    }
+                    if (k == 0)
+                        firstCorner = corner;
+                    else if (k >= 2) {
+                        *c++ = firstCorner;
+                        *c++ = previous;
+                        *c++ = corner;
+                    }
+                    previous = corner;
+                }
+            }
+            n.triangles += std::max(0, count - 2);
+        }
+        p = skipLine(p, end);
+    }
+    return n;
+}
+
+} // namespace detail
+
+// Reads the triangles of filename into mesh; returns false if the file cannot be read
+inline bool LoadFile(const std::string& filename, Mesh& mesh)
+{
+    using namespace detail;
+    mesh = Mesh();
+
+    const char* data = nullptr;
+    size_t size = 0;
+    std::string contents; // the file, where it cannot be mapped
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = size_t(st.st_size);
+        mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    data = static_cast<const char*>(mapped);
+#else
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+        return false;
+    contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    data = contents.data();
+    size = contents.size();
+#endif
+
+    // chunks of about 1 MB, starting at line starts
+    constexpr size_t chunkSize = 1 << 20;
+    int nChunks = int(std::max<size_t>(1, size / chunkSize));
+    std::vector<const char*> bounds(nChunks + 1);
+    bounds[0] = data;
+    bounds[nChunks] = data + size;
+    for (int k = 1; k < nChunks; ++k)
+        bounds[k] = std::max(bounds[k - 1], skipLine(data + size_t(k) * chunkSize, data + size));
+
+    std::vector<Counts> counts(nChunks + 1);
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < nChunks; ++k)
+        counts[k + 1] = parseChunk(bounds[k], bounds[k + 1], Counts(), nullptr, nullptr);
+    for (int k = 0; k < nChunks; ++k) {
+        counts[k + 1].v += counts[k].v;
+        counts[k + 1].vt += counts[k].vt;
+        counts[k + 1].vn += counts[k].vn;
+        counts[k + 1].triangles += counts[k].triangles;
+    }
+    const Counts& total = counts[nChunks];
+
+    std::vector<float> raw[3];
+    raw[0].resize(3 * total.v);
+    raw[1].resize(2 * total.vt);
+    raw[2].resize(3 * total.vn);
+    std::vector<Corner> corners(3 * total.triangles);
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < nChunks; ++k)
+        parseChunk(bounds[k], bounds[k + 1], counts[k], raw, &corners);
+
+#if defined(__unix__) || defined(__APPLE__)
+    munmap(mapped, size);
+#endif
+
+    // [comment]
+    // A vertex of the output is a distinct (position, uv, normal) triple. When every
+    // corner uses the same index for all three, or leaves the others out (the usual
+    // case), the positions are the vertices; otherwise the triples are numbered in the
+    // order they first appear.
+    // [/comment]
+    const int64_t nCorners = int64_t(corners.size());
+    bool hasUV = false, hasNormal = false, sameIndex = true;
+    #pragma omp parallel for reduction(||: hasUV, hasNormal) reduction(&&: sameIndex)
+    for (int64_t i = 0; i < nCorners; ++i) {
+        const Corner& c = corners[i];
+        hasUV = hasUV || c.vt >= 0;
+        hasNormal = hasNormal || c.vn >= 0;
+        sameIndex = sameIndex && c.v >= 0 && c.v < total.v && c.vt < total.vt && c.vn < total.vn &&
+                    (c.vt < 0 || c.vt == c.v) && (c.vn < 0 || c.vn == c.v);
+    }
+    // the triples of a corner leaving out uv or normal while others have them differ
+    sameIndex = sameIndex && std::all_of(corners.begin(), corners.end(), [&](const Corner& c) {
+        return (c.vt >= 0) == hasUV && (c.vn >= 0) == hasNormal;
+    });
+
+    mesh.indices.resize(nCorners);
+    if (sameIndex) {
+        #pragma omp parallel for
+        for (int64_t i = 0; i < nCorners; ++i)
+            mesh.indices[i] = uint32_t(corners[i].v);
+        mesh.positions.swap(raw[0]);
+        if (hasUV) {
+            raw[1].resize(2 * total.v);
+            mesh.texcoords.swap(raw[1]);
+        }
+        if (hasNormal) {
+            raw[2].resize(3 * total.v);
+            mesh.normals.swap(raw[2]);
+        }
+        return true;
+    }
+
+    std::vector<Corner> vertices;
+    std::unordered_map<Corner, uint32_t, CornerHash> ids;
+    ids.reserve(size_t(total.v));
+    for (int64_t i = 0; i < nCorners; ++i) {
+        auto [it, inserted] = ids.emplace(corners[i], uint32_t(vertices.size()));
+        if (inserted)
+            vertices.push_back(corners[i]);
+        mesh.indices[i] = it->second;
+    }
+    const int64_t nVertices = int64_t(vertices.size());
+    mesh.positions.resize(3 * nVertices);
+    if (hasUV)
+        mesh.texcoords.resize(2 * nVertices);
+    if (hasNormal)
+        mesh.normals.resize(3 * nVertices);
+    #pragma omp parallel for
+    for (int64_t i = 0; i < nVertices; ++i) {
+        const Corner& c = vertices[i];
+        for (int j = 0; j < 3; ++j)
+            mesh.positions[3 * i + j] = c.v >= 0 && c.v < total.v ? raw[0][3 * c.v + j] : 0.f;
+        for (int j = 0; j < 2 && hasUV; ++j)
+            mesh.texcoords[2 * i + j] = c.vt >= 0 && c.vt < total.vt ? raw[1][2 * c.vt + j] : 0.f;
+        for (int j = 0; j < 3 && hasNormal; ++j)
+            mesh.normals[3 * i + j] = c.vn >= 0 && c.vn < total.vn ? raw[2][3 * c.vn + j] : 0.f;
+    }
+    return true;
+}
+
+} // namespace objp
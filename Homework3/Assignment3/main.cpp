@@ -6,7 +6,7 @@
 #include "Triangle.hpp"
 #include "Shader.hpp"
 #include "Texture.hpp"
-#include "OBJ_Loader.h"
+#include "OBJ_Parser.hpp"
 
 Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
 {
@@ -292,24 +292,31 @@ int main(int argc, const char** argv)
     bool command_line = false;
 
     std::string filename = "output.png";
-    objl::Loader Loader;
+    objp::Mesh mesh;
     std::string obj_path = "../Assignment3/models/spot/";
 
     // Load .obj File
-    bool loadout = Loader.LoadFile("../Assignment3/models/spot/spot_triangulated_good.obj");
-    for(auto mesh:Loader.LoadedMeshes)
+    bool loadout = objp::LoadFile("../Assignment3/models/spot/spot_triangulated_good.obj", mesh);
+    for(size_t i=0;i<mesh.indices.size();i+=3)
     {
-        for(int i=0;i<mesh.Vertices.size();i+=3)
+        Triangle* t = new Triangle();
+        for(int j=0;j<3;j++)
         {
-            Triangle* t = new Triangle();
+            uint32_t k = mesh.indices[i+j];
+            t->setVertex(j,Vector4f(mesh.positions[3*k],mesh.positions[3*k+1],mesh.positions[3*k+2],1.0));
+            if(!mesh.texcoords.empty())
+                t->setTexCoord(j,Vector2f(mesh.texcoords[2*k], mesh.texcoords[2*k+1]));
+            if(!mesh.normals.empty())
+                t->setNormal(j,Vector3f(mesh.normals[3*k],mesh.normals[3*k+1],mesh.normals[3*k+2]));
+        }
+        if(mesh.normals.empty())
+        {
+            // no normals in the file: use the face normal, as objl::Loader did
+            Vector3f n = (t->v[1] - t->v[0]).head<3>().cross((t->v[2] - t->v[0]).head<3>()).normalized();
             for(int j=0;j<3;j++)
-            {
-                t->setVertex(j,Vector4f(mesh.Vertices[i+j].Position.X,mesh.Vertices[i+j].Position.Y,mesh.Vertices[i+j].Position.Z,1.0));
-                t->setNormal(j,Vector3f(mesh.Vertices[i+j].Normal.X,mesh.Vertices[i+j].Normal.Y,mesh.Vertices[i+j].Normal.Z));
-                t->setTexCoord(j,Vector2f(mesh.Vertices[i+j].TextureCoordinate.X, mesh.Vertices[i+j].TextureCoordinate.Y));
-            }
-            TriangleList.push_back(t);
+                t->setNormal(j,n);
         }
+        TriangleList.push_back(t);
     }
 
     rst::rasterizer r(700, 700);
@@ -0,0 +1,389 @@
+#include "ImageWriter.hpp"
+#include "global.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace
+{
+    // Values are always stored little-endian, except for the PNG fields which are big-endian.
+    void putLE32(std::vector<unsigned char>& out, uint32_t v)
+    {
+        for (int i = 0; i < 4; ++i)
+            out.push_back((unsigned char)(v >> (8 * i)));
+    }
+
+    void putBE32(std::vector<unsigned char>& out, uint32_t v)
+    {
+        for (int i = 3; i >= 0; --i)
+            out.push_back((unsigned char)(v >> (8 * i)));
+    }
+
+    void putString(std::vector<unsigned char>& out, const char* s)
+    {
+        out.insert(out.end(), s, s + strlen(s) + 1);
+    }
+
+    uint32_t floatBits(float f)
+    {
+        uint32_t u;
+        memcpy(&u, &f, sizeof(u));
+        return u;
+    }
+
+    // IEEE 754 binary32 -> binary16, rounding to nearest
+    uint16_t floatToHalf(float f)
+    {
+        uint32_t x = floatBits(f);
+        uint16_t sign = (x >> 16) & 0x8000;
+        int exponent = int((x >> 23) & 0xff) - 127 + 15;
+        uint32_t mantissa = x & 0x7fffff;
+
+        if (((x >> 23) & 0xff) == 0xff) // inf / nan
+            return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+        if (exponent >= 31) // overflow
+            return sign | 0x7c00;
+        if (exponent <= 0) // subnormal or zero
+        {
+            if (exponent < -10)
+                return sign;
+            mantissa |= 0x800000;
+            int shift = 14 - exponent;
+            uint16_t h = uint16_t(mantissa >> shift);
+            if ((mantissa >> (shift - 1)) & 1)
+                ++h;
+            return sign | h;
+        }
+        uint16_t h = sign | uint16_t(exponent << 10) | uint16_t(mantissa >> 13);
+        if (mantissa & 0x1000)
+            ++h; // a carry into the exponent is the correct result
+        return h;
+    }
+
+    uint32_t crc32(const unsigned char* data, size_t len, uint32_t crc = 0)
+    {
+        static const std::vector<uint32_t> table = [] {
+            std::vector<uint32_t> t(256);
+            for (uint32_t n = 0; n < 256; ++n)
+            {
+                uint32_t c = n;
+                for (int k = 0; k < 8; ++k)
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+            return t;
+        }();
+        crc = ~crc;
+        for (size_t i = 0; i < len; ++i)
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    void putPngChunk(std::vector<unsigned char>& out, const char* type, const unsigned char* data, size_t len)
+    {
+        putBE32(out, uint32_t(len));
+        size_t start = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data, data + len);
+        putBE32(out, crc32(out.data() + start, len + 4));
+    }
+
+    unsigned char toByte(float v, float gamma)
+    {
+        return (unsigned char)(255 * std::pow(clamp(0, 1, v), gamma));
+    }
+}
+
+ImageFormat imageFormatFromFilename(const std::string& filename)
+{
+    auto dot = filename.find_last_of('.');
+    std::string ext = dot == std::string::npos ? "" : filename.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (ext == "png")
+        return ImageFormat::PNG;
+    if (ext == "pfm")
+        return ImageFormat::PFM;
+    if (ext == "exr")
+        return ImageFormat::EXR;
+    return ImageFormat::PPM;
+}
+
+ImageWriter::ImageWriter(const std::string& filename, int w, int h, float g)
+    : ImageWriter(filename, imageFormatFromFilename(filename), w, h, g)
+{}
+
+ImageWriter::ImageWriter(const std::string& filename, ImageFormat fmt, int w, int h, float g)
+    : format(fmt), width(w), height(h), gamma(g), rowWritten(h, false)
+{
+    switch (format)
+    {
+        case ImageFormat::PPM: rowBytes = 3 * width; break;
+        case ImageFormat::PNG: rowBytes = 1 + 3 * width; break; // filter byte + RGB
+        case ImageFormat::PFM: rowBytes = 3 * 4 * width; break;
+        case ImageFormat::EXR: rowBytes = 8 + 3 * 2 * width; break; // y, byte count, B, G, R
+    }
+
+    fp = fopen(filename.c_str(), "wb");
+    if (!fp)
+    {
+        std::cerr << "Cannot open " << filename << " for writing\n";
+        return;
+    }
+    writeHeader();
+}
+
+ImageWriter::~ImageWriter()
+{
+    close();
+}
+
+void ImageWriter::writeHeader()
+{
+    std::vector<unsigned char> header;
+    char text[64];
+    switch (format)
+    {
+        case ImageFormat::PPM:
+            snprintf(text, sizeof(text), "P6\n%d %d\n255\n", width, height);
+            header.assign(text, text + strlen(text));
+            break;
+        case ImageFormat::PFM:
+            // a negative scale means little-endian samples
+            snprintf(text, sizeof(text), "PF\n%d %d\n-1.0\n", width, height);
+            header.assign(text, text + strlen(text));
+            break;
+        case ImageFormat::PNG:
+        {
+            const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+            header.assign(signature, signature + 8);
+            std::vector<unsigned char> ihdr;
+            putBE32(ihdr, width);
+            putBE32(ihdr, height);
+            ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0}); // 8-bit RGB, deflate, no interlace
+            putPngChunk(header, "IHDR", ihdr.data(), ihdr.size());
+            break;
+        }
+        case ImageFormat::EXR:
+        {
+            // single-part scanline file, uncompressed, one scanline per chunk
+            putLE32(header, 20000630);
+            putLE32(header, 2);
+            putString(header, "channels");
+            putString(header, "chlist");
+            putLE32(header, 3 * (2 + 16) + 1);
+            for (const char* channel : {"B", "G", "R"})
+            {
+                putString(header, channel);
+                putLE32(header, 1); // HALF
+                putLE32(header, 0); // pLinear + reserved
+                putLE32(header, 1); // x sampling
+                putLE32(header, 1); // y sampling
+            }
+            header.push_back(0);
+            putString(header, "compression");
+            putString(header, "compression");
+            putLE32(header, 1);
+            header.push_back(0);
+            for (const char* window : {"dataWindow", "displayWindow"})
+            {
+                putString(header, window);
+                putString(header, "box2i");
+                putLE32(header, 16);
+                putLE32(header, 0);
+                putLE32(header, 0);
+                putLE32(header, width - 1);
+                putLE32(header, height - 1);
+            }
+            putString(header, "lineOrder");
+            putString(header, "lineOrder");
+            putLE32(header, 1);
+            header.push_back(0); // increasing y
+            putString(header, "pixelAspectRatio");
+            putString(header, "float");
+            putLE32(header, 4);
+            putLE32(header, floatBits(1.f));
+            putString(header, "screenWindowCenter");
+            putString(header, "v2f");
+            putLE32(header, 8);
+            putLE32(header, floatBits(0.f));
+            putLE32(header, floatBits(0.f));
+            putString(header, "screenWindowWidth");
+            putString(header, "float");
+            putLE32(header, 4);
+            putLE32(header, floatBits(1.f));
+            header.push_back(0);
+
+            // the offset table is known up front since every chunk has the same size
+            uint64_t chunk = header.size() + 8 * uint64_t(height);
+            for (int y = 0; y < height; ++y, chunk += rowBytes)
+            {
+                putLE32(header, uint32_t(chunk));
+                putLE32(header, uint32_t(chunk >> 32));
+            }
+            break;
+        }
+    }
+    fwrite(header.data(), 1, header.size(), fp);
+    dataOffset = long(header.size());
+}
+
+long ImageWriter::rowOffset(int y) const
+{
+    // PFM stores the bottom row first
+    int row = format == ImageFormat::PFM ? height - 1 - y : y;
+    return dataOffset + long(row) * long(rowBytes);
+}
+
+void ImageWriter::encodeRow(const Vector3f* pixels, int y, unsigned char* out) const
+{
+    switch (format)
+    {
+        case ImageFormat::PNG:
+            *out++ = 0; // no filter
+            [[fallthrough]];
+        case ImageFormat::PPM:
+            for (int i = 0; i < width; ++i)
+            {
+                *out++ = toByte(pixels[i].x, gamma);
+                *out++ = toByte(pixels[i].y, gamma);
+                *out++ = toByte(pixels[i].z, gamma);
+            }
+            break;
+        case ImageFormat::PFM:
+            for (int i = 0; i < width; ++i)
+            {
+                for (float v : {pixels[i].x, pixels[i].y, pixels[i].z})
+                {
+                    uint32_t u = floatBits(v);
+                    for (int k = 0; k < 4; ++k)
+                        *out++ = (unsigned char)(u >> (8 * k));
+                }
+            }
+            break;
+        case ImageFormat::EXR:
+        {
+            uint32_t header[2] = {uint32_t(y), uint32_t(rowBytes - 8)};
+            for (uint32_t v : header)
+                for (int k = 0; k < 4; ++k)
+                    *out++ = (unsigned char)(v >> (8 * k));
+            for (int c = 2; c >= 0; --c) // channels are stored in alphabetical order: B, G, R
+            {
+                for (int i = 0; i < width; ++i)
+                {
+                    float v = c == 0 ? pixels[i].x : c == 1 ? pixels[i].y : pixels[i].z;
+                    uint16_t h = floatToHalf(v);
+                    *out++ = (unsigned char)h;
+                    *out++ = (unsigned char)(h >> 8);
+                }
+            }
+            break;
+        }
+    }
+}
+
+void ImageWriter::writeRows(int y0, int count, const Vector3f* pixels)
+{
+    if (!fp || count <= 0)
+        return;
+
+    std::vector<unsigned char> data(rowBytes * count);
+    for (int k = 0; k < count; ++k)
+    {
+        // keep the file order, which is reversed for PFM
+        int slot = format == ImageFormat::PFM ? count - 1 - k : k;
+        encodeRow(pixels + size_t(k) * width, y0 + k, data.data() + slot * rowBytes);
+        rowWritten[y0 + k] = true;
+    }
+
+    if (format != ImageFormat::PNG)
+    {
+        int first = format == ImageFormat::PFM ? y0 + count - 1 : y0;
+        fseek(fp, rowOffset(first), SEEK_SET);
+        fwrite(data.data(), 1, data.size(), fp);
+        return;
+    }
+
+    if (y0 != nextRow)
+    {
+        for (int k = 0; k < count; ++k)
+            pendingRows[y0 + k].assign(data.begin() + k * rowBytes, data.begin() + (k + 1) * rowBytes);
+        return;
+    }
+    nextRow += count;
+    for (auto it = pendingRows.begin(); it != pendingRows.end() && it->first == nextRow; it = pendingRows.erase(it))
+    {
+        data.insert(data.end(), it->second.begin(), it->second.end());
+        ++nextRow;
+    }
+    writePngData(data, nextRow == height);
+}
+
+// [comment]
+// Appends filtered scanlines to the zlib stream as one IDAT chunk. The data is kept in
+// "stored" deflate blocks, so no compressor state has to live between calls.
+// [/comment]
+void ImageWriter::writePngData(const std::vector<unsigned char>& data, bool last)
+{
+    for (unsigned char b : data)
+    {
+        adlerA = (adlerA + b) % 65521;
+        adlerB = (adlerB + adlerA) % 65521;
+    }
+
+    std::vector<unsigned char> idat;
+    idat.reserve(data.size() + data.size() / 65535 * 5 + 16);
+    if (!zlibStarted)
+    {
+        idat.insert(idat.end(), {0x78, 0x01}); // zlib header
+        zlibStarted = true;
+    }
+    size_t pos = 0;
+    do
+    {
+        size_t len = std::min<size_t>(65535, data.size() - pos);
+        bool final = last && pos + len == data.size();
+        idat.push_back(final ? 1 : 0);
+        idat.insert(idat.end(), {(unsigned char)len, (unsigned char)(len >> 8),
+                                 (unsigned char)~len, (unsigned char)(~len >> 8)});
+        idat.insert(idat.end(), data.begin() + pos, data.begin() + pos + len);
+        pos += len;
+    } while (pos < data.size());
+    if (last)
+        putBE32(idat, (adlerB << 16) | adlerA);
+
+    std::vector<unsigned char> chunk;
+    putPngChunk(chunk, "IDAT", idat.data(), idat.size());
+    fwrite(chunk.data(), 1, chunk.size(), fp);
+}
+
+void ImageWriter::close()
+{
+    if (!fp)
+        return;
+
+    std::vector<Vector3f> black(width);
+    for (int y = 0; y < height; ++y)
+        if (!rowWritten[y])
+            writeRows(y, 1, black.data());
+
+    if (format == ImageFormat::PNG)
+    {
+        std::vector<unsigned char> iend;
+        putPngChunk(iend, "IEND", nullptr, 0);
+        fwrite(iend.data(), 1, iend.size(), fp);
+    }
+    fclose(fp);
+    fp = nullptr;
+}
+
+bool writeImage(const std::string& filename, int width, int height, const std::vector<Vector3f>& framebuffer,
+                float gamma)
+{
+    ImageWriter writer(filename, width, height, gamma);
+    if (!writer.good())
+        return false;
+    writer.writeRows(0, height, framebuffer.data());
+    writer.close();
+    return true;
+}
@@ -2,6 +2,7 @@
 
 #include "Vector.hpp"
 #include "global.hpp"
+#include "Packet.hpp"
 
 class Object
 {
@@ -22,6 +23,28 @@ public:
     virtual void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t&, const Vector2f&, Vector3f&,
                                       Vector2f&) const = 0;
 
+#if RAYTRACING_HAS_PACKETS
+    // Intersects every active lane of the packet, keeping the closest hit per lane.
+    // The default traces the lanes one by one through the scalar intersect().
+    virtual void intersectPacket(PrimaryPacket& packet) const
+    {
+        for (int k = 0; k < packet.count; ++k)
+        {
+            float tNearK = kInfinity;
+            uint32_t indexK;
+            Vector2f uvK;
+            if (intersect(packet.origin(k), packet.direction(k), tNearK, indexK, uvK) && tNearK < packet.tNear[k])
+            {
+                packet.tNear[k] = tNearK;
+                packet.index[k] = indexK;
+                packet.u[k] = uvK.x;
+                packet.v[k] = uvK.y;
+                packet.hit_obj[k] = this;
+            }
+        }
+    }
+#endif
+
     virtual Vector3f evalDiffuseColor(const Vector2f&) const
     {
         return diffuseColor;
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <cstdint>
+#include "Vector.hpp"
+#include "global.hpp"
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// [comment]
+// Thin wrappers around the SSE (4 lanes) and AVX (8 lanes) registers so that the
+// packet kernels below can be written once and instantiated for either width.
+// Only the handful of operations needed by the ray-sphere and ray-triangle tests
+// are provided.
+// [/comment]
+#if defined(__SSE2__)
+struct vfloat4
+{
+    static constexpr int size = 4;
+    __m128 v;
+
+    vfloat4() = default;
+    vfloat4(__m128 x) : v(x) {}
+    vfloat4(float x) : v(_mm_set1_ps(x)) {}
+
+    static vfloat4 load(const float* p) { return _mm_load_ps(p); }
+    void store(float* p) const { _mm_store_ps(p, v); }
+
+    friend vfloat4 operator+(vfloat4 a, vfloat4 b) { return _mm_add_ps(a.v, b.v); }
+    friend vfloat4 operator-(vfloat4 a, vfloat4 b) { return _mm_sub_ps(a.v, b.v); }
+    friend vfloat4 operator*(vfloat4 a, vfloat4 b) { return _mm_mul_ps(a.v, b.v); }
+    friend vfloat4 operator/(vfloat4 a, vfloat4 b) { return _mm_div_ps(a.v, b.v); }
+    friend vfloat4 operator&(vfloat4 a, vfloat4 b) { return _mm_and_ps(a.v, b.v); }
+    friend vfloat4 operator<(vfloat4 a, vfloat4 b) { return _mm_cmplt_ps(a.v, b.v); }
+    friend vfloat4 operator>(vfloat4 a, vfloat4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+    friend vfloat4 operator>=(vfloat4 a, vfloat4 b) { return _mm_cmpge_ps(a.v, b.v); }
+
+    friend vfloat4 sqrt(vfloat4 a) { return _mm_sqrt_ps(a.v); }
+    friend vfloat4 min(vfloat4 a, vfloat4 b) { return _mm_min_ps(a.v, b.v); }
+    friend vfloat4 max(vfloat4 a, vfloat4 b) { return _mm_max_ps(a.v, b.v); }
+    // mask ? a : b
+    friend vfloat4 select(vfloat4 mask, vfloat4 a, vfloat4 b)
+    {
+        return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+    }
+    friend int movemask(vfloat4 a) { return _mm_movemask_ps(a.v); }
+};
+#endif
+
+#if defined(__AVX__)
+struct vfloat8
+{
+    static constexpr int size = 8;
+    __m256 v;
+
+    vfloat8() = default;
+    vfloat8(__m256 x) : v(x) {}
+    vfloat8(float x) : v(_mm256_set1_ps(x)) {}
+
+    static vfloat8 load(const float* p) { return _mm256_load_ps(p); }
+    void store(float* p) const { _mm256_store_ps(p, v); }
+
+    friend vfloat8 operator+(vfloat8 a, vfloat8 b) { return _mm256_add_ps(a.v, b.v); }
+    friend vfloat8 operator-(vfloat8 a, vfloat8 b) { return _mm256_sub_ps(a.v, b.v); }
+    friend vfloat8 operator*(vfloat8 a, vfloat8 b) { return _mm256_mul_ps(a.v, b.v); }
+    friend vfloat8 operator/(vfloat8 a, vfloat8 b) { return _mm256_div_ps(a.v, b.v); }
+    friend vfloat8 operator&(vfloat8 a, vfloat8 b) { return _mm256_and_ps(a.v, b.v); }
+    friend vfloat8 operator<(vfloat8 a, vfloat8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+    friend vfloat8 operator>(vfloat8 a, vfloat8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+    friend vfloat8 operator>=(vfloat8 a, vfloat8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+
+    friend vfloat8 sqrt(vfloat8 a) { return _mm256_sqrt_ps(a.v); }
+    friend vfloat8 min(vfloat8 a, vfloat8 b) { return _mm256_min_ps(a.v, b.v); }
+    friend vfloat8 max(vfloat8 a, vfloat8 b) { return _mm256_max_ps(a.v, b.v); }
+    // mask ? a : b
+    friend vfloat8 select(vfloat8 mask, vfloat8 a, vfloat8 b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+    friend int movemask(vfloat8 a) { return _mm256_movemask_ps(a.v); }
+};
+#endif
+
+// [comment]
+// Widest packet supported by the target. When neither SSE nor AVX is available
+// the renderer falls back to tracing one ray at a time.
+// [/comment]
+#if defined(__AVX__)
+using vfloat = vfloat8;
+#define RAYTRACING_HAS_PACKETS 1
+#elif defined(__SSE2__)
+using vfloat = vfloat4;
+#define RAYTRACING_HAS_PACKETS 1
+#else
+#define RAYTRACING_HAS_PACKETS 0
+#endif
+
+class Object;
+
+// [comment]
+// A bundle of rays stored as a structure of arrays, one lane per ray. The hit
+// fields mirror hit_payload: tNear is the closest distance found so far and is
+// updated in place by every kernel, so objects can be tested in any order.
+// Inactive lanes (past *count*) must carry tNear = 0 so that nothing can hit them.
+// [/comment]
+template <int N>
+struct RayPacket
+{
+    static constexpr int size = N;
+
+    alignas(32) float ox[N], oy[N], oz[N];
+    alignas(32) float dx[N], dy[N], dz[N];
+    alignas(32) float tNear[N];
+    alignas(32) float u[N], v[N];
+    uint32_t index[N];
+    const Object* hit_obj[N];
+    int count = 0;
+
+    void set(int lane, const Vector3f& orig, const Vector3f& dir)
+    {
+        ox[lane] = orig.x, oy[lane] = orig.y, oz[lane] = orig.z;
+        dx[lane] = dir.x, dy[lane] = dir.y, dz[lane] = dir.z;
+        tNear[lane] = kInfinity;
+        u[lane] = v[lane] = 0;
+        index[lane] = 0;
+        hit_obj[lane] = nullptr;
+    }
+
+    void reset(int n)
+    {
+        count = n;
+        for (int k = n; k < N; ++k)
+        {
+            set(k, Vector3f(0), Vector3f(0, 0, -1));
+            tNear[k] = 0;
+        }
+    }
+
+    Vector3f origin(int lane) const { return Vector3f(ox[lane], oy[lane], oz[lane]); }
+    Vector3f direction(int lane) const { return Vector3f(dx[lane], dy[lane], dz[lane]); }
+};
+
+#if RAYTRACING_HAS_PACKETS
+using PrimaryPacket = RayPacket<vfloat::size>;
+
+// [comment]
+// Packet version of Sphere::intersect. Uses the same numerically stable form of the
+// quadratic as solveQuadratic(); the discr == 0 case falls out of the general formula.
+// Returns the mask of lanes whose tNear was updated.
+// [/comment]
+template <typename V, int N>
+inline int spherePacketIntersect(const Vector3f& center, float radius2, RayPacket<N>& packet, int lane0)
+{
+    V dx = V::load(packet.dx + lane0), dy = V::load(packet.dy + lane0), dz = V::load(packet.dz + lane0);
+    V Lx = V::load(packet.ox + lane0) - V(center.x);
+    V Ly = V::load(packet.oy + lane0) - V(center.y);
+    V Lz = V::load(packet.oz + lane0) - V(center.z);
+
+    V a = dx * dx + dy * dy + dz * dz;
+    V b = V(2.f) * (dx * Lx + dy * Ly + dz * Lz);
+    V c = Lx * Lx + Ly * Ly + Lz * Lz - V(radius2);
+    V discr = b * b - V(4.f) * a * c;
+    V valid = discr >= V(0.f);
+    V root = sqrt(max(discr, V(0.f)));
+    V q = V(-0.5f) * select(b > V(0.f), b + root, b - root);
+    V x0 = q / a, x1 = c / q;
+    V t0 = min(x0, x1), t1 = max(x0, x1);
+    V t = select(t0 < V(0.f), t1, t0);
+
+    V tNear = V::load(packet.tNear + lane0);
+    V hit = valid & (t >= V(0.f)) & (t < tNear);
+    select(hit, t, tNear).store(packet.tNear + lane0);
+    return movemask(hit);
+}
+
+// [comment]
+// Packet version of rayTriangleIntersect (Moller-Trumbore): one triangle against
+// V::size rays. Returns the mask of lanes whose tNear, u and v were updated.
+// [/comment]
+template <typename V, int N>
+inline int trianglePacketIntersect(const Vector3f& v0, const Vector3f& e1, const Vector3f& e2,
+                                   RayPacket<N>& packet, int lane0)
+{
+    V dx = V::load(packet.dx + lane0), dy = V::load(packet.dy + lane0), dz = V::load(packet.dz + lane0);
+    V sx = V::load(packet.ox + lane0) - V(v0.x);
+    V sy = V::load(packet.oy + lane0) - V(v0.y);
+    V sz = V::load(packet.oz + lane0) - V(v0.z);
+
+    // s1 = dir x e2, s2 = s x e1
+    V s1x = dy * V(e2.z) - dz * V(e2.y);
+    V s1y = dz * V(e2.x) - dx * V(e2.z);
+    V s1z = dx * V(e2.y) - dy * V(e2.x);
+    V s2x = sy * V(e1.z) - sz * V(e1.y);
+    V s2y = sz * V(e1.x) - sx * V(e1.z);
+    V s2z = sx * V(e1.y) - sy * V(e1.x);
+
+    V param = V(1.f) / (s1x * V(e1.x) + s1y * V(e1.y) + s1z * V(e1.z));
+    V t = param * (s2x * V(e2.x) + s2y * V(e2.y) + s2z * V(e2.z));
+    V b1 = param * (s1x * sx + s1y * sy + s1z * sz);
+    V b2 = param * (s2x * dx + s2y * dy + s2z * dz);
+
+    V tNear = V::load(packet.tNear + lane0);
+    V hit = (t > V(0.f)) & (b1 > V(0.f)) & (b2 > V(0.f)) & (V(1.f) - b1 - b2 > V(0.f)) & (t < tNear);
+    select(hit, t, tNear).store(packet.tNear + lane0);
+    select(hit, b1, V::load(packet.u + lane0)).store(packet.u + lane0);
+    select(hit, b2, V::load(packet.v + lane0)).store(packet.v + lane0);
+    return movemask(hit);
+}
+#endif
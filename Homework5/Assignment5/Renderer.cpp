@@ -2,6 +2,7 @@
 #include "Vector.hpp"
 #include "Renderer.hpp"
 #include "Scene.hpp"
+#include "ImageWriter.hpp"
 #include <optional>
 
 inline float deg2rad(const float &deg)
@@ -105,11 +106,28 @@ std::optional<hit_payload> trace(
     return payload;
 }
 
+// [comment]
+// Traces a packet of rays against all the objects of the scene. This is the packet
+// counterpart of trace(): on return, every active lane holds its closest hit, if any.
+// [/comment]
+#if RAYTRACING_HAS_PACKETS
+void tracePacket(PrimaryPacket& packet, const std::vector<std::unique_ptr<Object> > &objects)
+{
+    for (const auto & object : objects)
+        object->intersectPacket(packet);
+}
+#endif
+
+Vector3f castRay(
+        const Vector3f &orig, const Vector3f &dir, const Scene& scene,
+        int depth);
+
 // [comment]
 // Implementation of the Whitted-style light transport algorithm (E [S*] (D|G) L)
 //
 // This function is the function that compute the color at the intersection point
-// of a ray defined by a position and a direction. Note that thus function is recursive (it calls itself).
+// found by trace() for the ray defined by a position and a direction. It is recursive
+// through castRay().
 //
 // If the material of the intersected object is either reflective or reflective and refractive,
 // then we compute the reflection/refraction direction and cast two new rays into the scene
@@ -121,16 +139,12 @@ std::optional<hit_payload> trace(
 // If the surface is diffuse/glossy we use the Phong illumation model to compute the color
 // at the intersection point.
 // [/comment]
-Vector3f castRay(
-        const Vector3f &orig, const Vector3f &dir, const Scene& scene,
-        int depth)
+Vector3f shade(
+        const Vector3f &orig, const Vector3f &dir, const std::optional<hit_payload> &payload,
+        const Scene& scene, int depth)
 {
-    if (depth > scene.maxDepth) {
-        return Vector3f(0.0,0.0,0.0);
-    }
-
     Vector3f hitColor = scene.backgroundColor;
-    if (auto payload = trace(orig, dir, scene.get_objects()); payload)
+    if (payload)
     {
         Vector3f hitPoint = orig + dir * payload->tNear;
         Vector3f N; // normal
@@ -203,6 +217,20 @@ Vector3f castRay(
     return hitColor;
 }
 
+// [comment]
+// Computes the color seen along the ray defined by a position and a direction.
+// [/comment]
+Vector3f castRay(
+        const Vector3f &orig, const Vector3f &dir, const Scene& scene,
+        int depth)
+{
+    if (depth > scene.maxDepth) {
+        return Vector3f(0.0,0.0,0.0);
+    }
+
+    return shade(orig, dir, trace(orig, dir, scene.get_objects()), scene, depth);
+}
+
 // [comment]
 // The main render function. This where we iterate over all pixels in the image, generate
 // primary rays and cast these rays into the scene. The content of the framebuffer is
@@ -218,32 +246,57 @@ void Renderer::Render(const Scene& scene)
     // Use this variable as the eye position to start your rays.
     Vector3f eye_pos(0);
     int m = 0;
-    for (int j = 0; j < scene.height; ++j)
+
+    // rows are saved to the file as soon as they are finished
+    ImageWriter writer(outputFile, scene.width, scene.height);
+#if RAYTRACING_HAS_PACKETS
+    if (usePackets)
     {
-        for (int i = 0; i < scene.width; ++i)
+        // Primary rays of neighbouring pixels are coherent: trace them PrimaryPacket::size
+        // at a time, then shade every lane with the scalar code.
+        PrimaryPacket packet;
+        for (int j = 0; j < scene.height; ++j)
         {
-            // generate primary ray direction
-            float x = (2 / float(scene.width) * (i + 0.5) - 1) * scale * imageAspectRatio;
             float y = (1 - 2 / float(scene.height) * (j + 0.5)) * scale;
-            // TODO: Find the x and y positions of the current pixel to get the direction
-            // vector that passes through it.
-            // Also, don't forget to multiply both of them with the variable *scale*, and
-            // x (horizontal) variable with the *imageAspectRatio*
-            Vector3f dir = normalize(Vector3f(x, y, -1)); // Don't forget to normalize this direction!
-            framebuffer[m++] = castRay(eye_pos, dir, scene, 0);
+            for (int i = 0; i < scene.width; i += PrimaryPacket::size)
+            {
+                packet.reset(std::min(PrimaryPacket::size, scene.width - i));
+                for (int k = 0; k < packet.count; ++k)
+                {
+                    float x = (2 / float(scene.width) * (i + k + 0.5) - 1) * scale * imageAspectRatio;
+                    packet.set(k, eye_pos, normalize(Vector3f(x, y, -1)));
+                }
+                tracePacket(packet, scene.get_objects());
+                for (int k = 0; k < packet.count; ++k)
+                {
+                    std::optional<hit_payload> payload;
+                    if (packet.hit_obj[k])
+                        payload = hit_payload{packet.tNear[k], packet.index[k], Vector2f(packet.u[k], packet.v[k]),
+                                              packet.hit_obj[k]};
+                    framebuffer[m++] = shade(eye_pos, packet.direction(k), payload, scene, 0);
+                }
+            }
+            writer.writeRows(j, 1, &framebuffer[j * scene.width]);
+            UpdateProgress(j / (float)scene.height);
         }
-        UpdateProgress(j / (float)scene.height);
     }
-
-    // save framebuffer to file
-    FILE* fp = fopen("binary.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    for (auto i = 0; i < scene.height * scene.width; ++i) {
-        static unsigned char color[3];
-        color[0] = (char)(255 * clamp(0, 1, framebuffer[i].x));
-        color[1] = (char)(255 * clamp(0, 1, framebuffer[i].y));
-        color[2] = (char)(255 * clamp(0, 1, framebuffer[i].z));
-        fwrite(color, 1, 3, fp);
+    else
+#endif
+    {
+        for (int j = 0; j < scene.height; ++j)
+        {
+            for (int i = 0; i < scene.width; ++i)
+            {
+                // generate primary ray direction
+                float x = (2 / float(scene.width) * (i + 0.5) - 1) * scale * imageAspectRatio;
+                float y = (1 - 2 / float(scene.height) * (j + 0.5)) * scale;
+                Vector3f dir = normalize(Vector3f(x, y, -1));
+                framebuffer[m++] = castRay(eye_pos, dir, scene, 0);
+            }
+            writer.writeRows(j, 1, &framebuffer[j * scene.width]);
+            UpdateProgress(j / (float)scene.height);
+        }
     }
-    fclose(fp);
+
+    writer.close();
 }
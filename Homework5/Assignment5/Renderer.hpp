@@ -1,4 +1,5 @@
 #pragma once
+#include <string>
 #include "Scene.hpp"
 
 struct hit_payload
@@ -6,7 +7,7 @@ struct hit_payload
     float tNear;
     uint32_t index;
     Vector2f uv;
-    Object* hit_obj;
+    const Object* hit_obj;
 };
 
 class Renderer
@@ -14,5 +15,12 @@ class Renderer
 public:
     void Render(const Scene& scene);
 
+    // Trace primary rays in SIMD packets when the target supports it. The scalar
+    // path is kept as the fallback and for comparison.
+    bool usePackets = true;
+
+    // The format is picked from the extension: .ppm, .png, .pfm or .exr (half float)
+    std::string outputFile = "binary.ppm";
+
 private:
 };
\ No newline at end of file
@@ -31,6 +31,16 @@ public:
         return true;
     }
 
+#if RAYTRACING_HAS_PACKETS
+    void intersectPacket(PrimaryPacket& packet) const override
+    {
+        int mask = spherePacketIntersect<vfloat>(center, radius2, packet, 0);
+        for (int k = 0; k < PrimaryPacket::size; ++k)
+            if (mask & (1 << k))
+                packet.hit_obj[k] = this;
+    }
+#endif
+
     void getSurfaceProperties(const Vector3f& P, const Vector3f&, const uint32_t&, const Vector2f&,
                               Vector3f& N, Vector2f&) const override
     {
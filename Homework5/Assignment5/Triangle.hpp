@@ -65,6 +65,27 @@ public:
         return intersect;
     }
 
+#if RAYTRACING_HAS_PACKETS
+    void intersectPacket(PrimaryPacket& packet) const override
+    {
+        for (uint32_t k = 0; k < numTriangles; ++k)
+        {
+            const Vector3f& v0 = vertices[vertexIndex[k * 3]];
+            const Vector3f& v1 = vertices[vertexIndex[k * 3 + 1]];
+            const Vector3f& v2 = vertices[vertexIndex[k * 3 + 2]];
+            int mask = trianglePacketIntersect<vfloat>(v0, v1 - v0, v2 - v0, packet, 0);
+            for (int lane = 0; lane < PrimaryPacket::size; ++lane)
+            {
+                if (mask & (1 << lane))
+                {
+                    packet.index[lane] = k;
+                    packet.hit_obj[lane] = this;
+                }
+            }
+        }
+    }
+#endif
+
     void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t& index, const Vector2f& uv, Vector3f& N,
                               Vector2f& st) const override
     {
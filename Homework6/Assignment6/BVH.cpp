@@ -1,115 +1,385 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include "BVH.hpp"
 
+// Bounds and centroid of a primitive, computed once before the build
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(int primitiveNumber, const Bounds3& bounds)
+        : primitiveNumber(primitiveNumber), bounds(bounds), centroid(0.5 * bounds.pMin + 0.5 * bounds.pMax) {}
+    int primitiveNumber;
+    Bounds3 bounds;
+    Vector3f centroid;
+};
+
+// ranges smaller than this are built by the task that reaches them
+static constexpr int kParallelBuildThreshold = 4096;
+
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
                    SplitMethod splitMethod)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
       primitives(std::move(p))
 {
-    time_t start, stop;
-    time(&start);
+    auto start = std::chrono::steady_clock::now();
     if (primitives.empty())
         return;
 
-    root = recursiveBuild(primitives);
+    // [comment]
+    // The builders reorder info within the range of each node, so that in the end the
+    // leaves cover consecutive ranges of it and primitives can be put in the same order.
+    // Subtrees are built as OpenMP tasks.
+    // [/comment]
+    int n = int(primitives.size());
+    std::vector<BVHPrimitiveInfo> info(n);
+    #pragma omp parallel for
+    for (int i = 0; i < n; ++i)
+        info[i] = BVHPrimitiveInfo(i, primitives[i]->getBounds());
+
+    #pragma omp parallel
+    #pragma omp single
+    root = splitMethod == SplitMethod::LBVH ? buildLBVH(info) : recursiveBuild(info, 0, n);
+
+    std::vector<Object*> ordered(n);
+    for (int i = 0; i < n; ++i)
+        ordered[i] = primitives[info[i].primitiveNumber];
+    primitives.swap(ordered);
+    nodes.reserve(totalNodes(root));
+    flattenBVHTree(root);
+    updateStackSize();
 
-    time(&stop);
-    double diff = difftime(stop, start);
-    int hrs = (int)diff / 3600;
-    int mins = ((int)diff / 60) - (hrs * 60);
-    int secs = (int)diff - (hrs * 3600) - (mins * 60);
+    // the build tree is not needed any more
+    double cost = SAHCost();
+    root = nullptr;
+    buildNodes.clear();
 
-    printf(
-        "\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n",
-        hrs, mins, secs);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("\rBVH Generation complete: \nTime Taken: %.2f ms (%d primitives)\nSAH cost: %.2f\n\n", ms, n, cost);
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+BVHAccel::~BVHAccel() = default;
+
+// Makes node a leaf holding info[start, end)
+void BVHAccel::initLeaf(BVHBuildNode* node, const std::vector<BVHPrimitiveInfo>& info, int start, int end,
+                        const Bounds3& bounds) const
 {
-    BVHBuildNode* node = new BVHBuildNode();
+    node->bounds = bounds;
+    node->object = primitives[info[start].primitiveNumber];
+    node->left = nullptr;
+    node->right = nullptr;
+    node->firstPrimOffset = start;
+    node->nPrimitives = end - start;
+}
+
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& info, int start, int end)
+{
+    BVHBuildNode* node = buildNodes.alloc();
 
     // Compute bounds of all primitives in BVH node
-    Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
-        // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
+    Bounds3 bounds, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        bounds = Union(bounds, info[i].bounds);
+        centroidBounds = Union(centroidBounds, info[i].centroid);
+    }
+    int n = end - start;
+    if (n == 1) {
+        initLeaf(node, info, start, end, bounds);
         return node;
     }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
+    int dim = centroidBounds.maxExtent();
+    int mid = end;
+    double splitCost = std::numeric_limits<double>::max();
+    if (splitMethod == SplitMethod::SAH)
+        mid = partitionSAH(info, start, end, bounds, centroidBounds, dim, splitCost);
+
+    // keep small sets together when intersecting all of them (cost 1 each) is cheaper
+    if (n <= maxPrimsInNode && n <= splitCost) {
+        initLeaf(node, info, start, end, bounds);
         return node;
     }
-    else {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds =
-                Union(centroidBounds, objects[i]->getBounds().Centroid());
-        int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                       f2->getBounds().Centroid().x;
-            });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                       f2->getBounds().Centroid().y;
-            });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                       f2->getBounds().Centroid().z;
-            });
-            break;
+
+    if (mid == start || mid == end) {
+        // NAIVE, or SAH found no useful split: cut at the median along the largest extent
+        mid = start + n / 2;
+        std::nth_element(info.begin() + start, info.begin() + mid, info.begin() + end,
+                         [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                             return a.centroid[dim] < b.centroid[dim];
+                         });
+    }
+    node->splitAxis = dim;
+
+    #pragma omp task shared(info) if(n > kParallelBuildThreshold)
+    node->left = recursiveBuild(info, start, mid);
+    node->right = recursiveBuild(info, mid, end);
+    #pragma omp taskwait
+
+    node->bounds = bounds;
+    return node;
+}
+
+// Binned SAH split. The primitive centroids are sorted into nBuckets buckets along each
+// axis, and info[start, end) is partitioned at the bucket boundary with the lowest estimated cost
+//     C = C_trav + (N_left * SA(left) + N_right * SA(right)) / SA(node)
+// Returns end if there is no boundary to split at (all centroids fall in one bucket),
+// otherwise the start of the right part, and sets splitAxis to the axis of the split and
+// cost to its estimated cost.
+int BVHAccel::partitionSAH(std::vector<BVHPrimitiveInfo>& info, int start, int end, const Bounds3& bounds,
+                           const Bounds3& centroidBounds, int& splitAxis, double& cost) const
+{
+    constexpr int nBuckets = 16;
+    constexpr double traversalCost = 0.125; // relative to one primitive intersection
+
+    auto bucketOf = [&](const BVHPrimitiveInfo& p, int dim) {
+        const Vector3f offset = centroidBounds.Offset(p.centroid);
+        int k = int(nBuckets * offset[dim]);
+        return std::min(std::max(k, 0), nBuckets - 1);
+    };
+
+    double bestCost = std::numeric_limits<double>::max();
+    int bestDim = -1, bestSplit = -1;
+    for (int dim = 0; dim < 3; ++dim) {
+        if (centroidBounds.pMax[dim] <= centroidBounds.pMin[dim])
+            continue;
+
+        int count[nBuckets] = {};
+        Bounds3 bucketBounds[nBuckets];
+        for (int i = start; i < end; ++i) {
+            int b = bucketOf(info[i], dim);
+            ++count[b];
+            bucketBounds[b] = Union(bucketBounds[b], info[i].bounds);
+        }
+
+        // sweep from the right to get the area and count above every boundary
+        double rightArea[nBuckets - 1];
+        int rightCount[nBuckets - 1];
+        Bounds3 right;
+        int n = 0;
+        for (int b = nBuckets - 1; b > 0; --b) {
+            right = Union(right, bucketBounds[b]);
+            n += count[b];
+            rightArea[b - 1] = n > 0 ? right.SurfaceArea() : 0;
+            rightCount[b - 1] = n;
+        }
+
+        Bounds3 left;
+        n = 0;
+        for (int b = 0; b < nBuckets - 1; ++b) {
+            left = Union(left, bucketBounds[b]);
+            n += count[b];
+            if (n == 0 || rightCount[b] == 0)
+                continue;
+            double cost = traversalCost +
+                          (n * left.SurfaceArea() + rightCount[b] * rightArea[b]) / bounds.SurfaceArea();
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestDim = dim;
+                bestSplit = b;
+            }
         }
+    }
+
+    if (bestDim < 0)
+        return end;
+    splitAxis = bestDim;
+    cost = bestCost;
+    return int(std::partition(info.begin() + start, info.begin() + end, [&](const BVHPrimitiveInfo& p) {
+        return bucketOf(p, bestDim) <= bestSplit;
+    }) - info.begin());
+}
 
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
+// Spreads the low 10 bits of v to every third bit
+static uint32_t leftShift3(uint32_t v)
+{
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// [comment]
+// Linear BVH (Lauterbach et al., "Fast BVH Construction on GPUs", 2009): the primitives
+// are sorted along the Morton curve of their centroids (30-bit codes, radix sorted), and
+// every node splits its range where the highest bit in which its codes differ turns to
+// 1. Much faster to build than SAH, at the price of a worse tree.
+// [/comment]
+BVHBuildNode* BVHAccel::buildLBVH(std::vector<BVHPrimitiveInfo>& info)
+{
+    int n = int(info.size());
+    Bounds3 centroidBounds;
+    for (const auto& p : info)
+        centroidBounds = Union(centroidBounds, p.centroid);
+
+    std::vector<uint32_t> codes(n), sortedCodes(n);
+    #pragma omp taskloop shared(info, codes, centroidBounds)
+    for (int i = 0; i < n; ++i) {
+        const Vector3f o = centroidBounds.Offset(info[i].centroid);
+        auto quantize = [](float x) { return uint32_t(std::min(std::max(x * 1024.f, 0.f), 1023.f)); };
+        codes[i] = (leftShift3(quantize(o.x)) << 2) | (leftShift3(quantize(o.y)) << 1) | leftShift3(quantize(o.z));
+    }
 
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
+    // LSD radix sort of the codes with the indices of their primitives, 10 bits per pass;
+    // the (larger) primitive infos are moved once, at the end
+    std::vector<int> order(n), sortedOrder(n);
+    for (int i = 0; i < n; ++i)
+        order[i] = i;
+    for (int shift = 0; shift < 30; shift += 10) {
+        std::vector<int> offset(1025, 0);
+        for (uint32_t code : codes)
+            ++offset[((code >> shift) & 1023) + 1];
+        for (int b = 0; b < 1024; ++b)
+            offset[b + 1] += offset[b];
+        for (int i = 0; i < n; ++i) {
+            int k = offset[(codes[i] >> shift) & 1023]++;
+            sortedCodes[k] = codes[i];
+            sortedOrder[k] = order[i];
+        }
+        codes.swap(sortedCodes);
+        order.swap(sortedOrder);
+    }
+    std::vector<BVHPrimitiveInfo> sortedInfo(n);
+    for (int i = 0; i < n; ++i)
+        sortedInfo[i] = info[order[i]];
+    info.swap(sortedInfo);
 
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+    return emitLBVH(info, codes, 0, n);
+}
 
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+BVHBuildNode* BVHAccel::emitLBVH(const std::vector<BVHPrimitiveInfo>& info, const std::vector<uint32_t>& codes,
+                                 int start, int end)
+{
+    BVHBuildNode* node = buildNodes.alloc();
+    int n = end - start;
+    if (n <= maxPrimsInNode) {
+        Bounds3 bounds;
+        for (int i = start; i < end; ++i)
+            bounds = Union(bounds, info[i].bounds);
+        initLeaf(node, info, start, end, bounds);
+        return node;
+    }
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
+    int mid = start + n / 2;
+    if (uint32_t diff = codes[start] ^ codes[end - 1]) {
+        int bit = 31 - __builtin_clz(diff);
+        mid = int(std::partition_point(codes.begin() + start, codes.begin() + end,
+                                       [bit](uint32_t code) { return !(code >> bit & 1); }) - codes.begin());
+        // bits 3k + 2, 3k + 1 and 3k come from x, y and z
+        node->splitAxis = 2 - bit % 3;
     }
 
+    #pragma omp task shared(info, codes) if(n > kParallelBuildThreshold)
+    node->left = emitLBVH(info, codes, start, mid);
+    node->right = emitLBVH(info, codes, mid, end);
+    #pragma omp taskwait
+
+    node->bounds = Union(node->left->bounds, node->right->bounds);
     return node;
 }
 
-Intersection BVHAccel::Intersect(const Ray& ray) const
+// Expected cost of a ray query, relative to one primitive intersection:
+// the sum over the nodes of the probability to visit them (surface area ratio)
+// times their cost (traversal for interior nodes, intersection for leaves).
+double BVHAccel::SAHCost() const
 {
-    Intersection isect;
     if (!root)
-        return isect;
-    isect = BVHAccel::getIntersection(root, ray);
-    return isect;
+        return 0;
+    return SAHCost(root) / root->bounds.SurfaceArea();
+}
+
+double BVHAccel::SAHCost(BVHBuildNode* node) const
+{
+    if (!node->left && !node->right)
+        return node->nPrimitives * node->bounds.SurfaceArea();
+    return 0.125 * node->bounds.SurfaceArea() + SAHCost(node->left) + SAHCost(node->right);
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+int BVHAccel::totalNodes(BVHBuildNode* node) const
+{
+    return node ? 1 + totalNodes(node->left) + totalNodes(node->right) : 0;
+}
+
+// Appends the subtree to the node array in depth-first order (the leaves already are in
+// that order in primitives). Returns the index of the subtree root.
+int BVHAccel::flattenBVHTree(BVHBuildNode* node)
+{
+    int offset = int(nodes.size());
+    nodes.emplace_back();
+    nodes[offset].setBounds(node->bounds);
+    if (!node->left && !node->right) {
+        nodes[offset].primitivesOffset = node->firstPrimOffset;
+        nodes[offset].nPrimitives = uint16_t(node->nPrimitives);
+    }
+    else {
+        // the first child directly follows its parent
+        nodes[offset].axis = uint8_t(node->splitAxis);
+        nodes[offset].nPrimitives = 0;
+        flattenBVHTree(node->left);
+        nodes[offset].secondChildOffset = flattenBVHTree(node->right);
+    }
+    return offset;
+}
+
+void BVHAccel::updateStackSize()
+{
+    // children follow their parents, so one pass in order gives the depth of every node
+    int n = int(nodes.size()), maxDepth = 0;
+    std::vector<int> depth(n, 1);
+    for (int i = 0; i < n; ++i) {
+        maxDepth = std::max(maxDepth, depth[i]);
+        if (nodes[i].nPrimitives == 0) {
+            depth[i + 1] = depth[i] + 1;
+            depth[nodes[i].secondChildOffset] = depth[i] + 1;
+        }
+    }
+    stackSize = std::max(1, maxDepth - 1);
+}
+
+Intersection BVHAccel::Intersect(const Ray& ray) const
 {
-    // TODO Traverse the BVH to find intersection
     Intersection isect;
-    if (!node->bounds.IntersectP(ray, ray.direction_inv, { int(ray.direction.x < 0), int(ray.direction.y < 0), int(ray.direction.z < 0) }))
+    if (nodes.empty())
         return isect;
-    if (!node->left && !node->right)
-        return node->object->getIntersection(ray);
-    Intersection left = getIntersection(node->left, ray), right = getIntersection(node->right, ray);
-    return left.distance < right.distance ? left : right;
-}
\ No newline at end of file
+
+    // Traverse the flattened tree with an explicit stack, nearest child first. Nodes that
+    // start beyond the closest hit found so far are skipped.
+    std::array<int, 3> dirIsNeg = {int(ray.direction.x < 0), int(ray.direction.y < 0), int(ray.direction.z < 0)};
+    float tClosest = std::numeric_limits<float>::infinity();
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int local[kLocalStackSize];
+    std::vector<int> heap;
+    int* nodesToVisit = stackSize > kLocalStackSize ? (heap.resize(stackSize), heap.data()) : local;
+    while (true) {
+        const LinearBVHNode& node = nodes[currentNodeIndex];
+        if (node.IntersectP(ray, ray.direction_inv, dirIsNeg, tClosest)) {
+            if (node.nPrimitives > 0) {
+                for (int i = 0; i < node.nPrimitives; ++i) {
+                    Intersection hit = primitives[node.primitivesOffset + i]->getIntersection(ray);
+                    if (hit.happened && hit.distance < tClosest) {
+                        isect = hit;
+                        tClosest = hit.distance;
+                    }
+                }
+                if (toVisitOffset == 0)
+                    break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else {
+                if (dirIsNeg[node.axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node.secondChildOffset;
+                }
+                else {
+                    nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        }
+        else {
+            if (toVisitOffset == 0)
+                break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return isect;
+}
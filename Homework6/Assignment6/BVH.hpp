@@ -13,38 +13,56 @@
 #include "Ray.hpp"
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
+#include "MemoryArena.hpp"
 #include "Vector.hpp"
 
 struct BVHBuildNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
 
-// BVHAccel Declarations
-inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
-class BVHAccel {
-
-public:
-    // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
-
-    // BVHAccel Public Methods
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
-    Bounds3 WorldBound() const;
-    ~BVHAccel();
+// Node of the flattened BVH. Nodes are stored depth first, so the first child of an
+// interior node directly follows it and only the second child needs an offset. The bounds
+// are plain floats rather than a Bounds3, whose SSE vectors would make the node 48 bytes;
+// IntersectP loads them straight into registers, and bounds() into a Bounds3.
+struct alignas(32) LinearBVHNode {
+    float pMin[3], pMax[3];
+    union {
+        int primitivesOffset;   // leaf
+        int secondChildOffset;  // interior
+    };
+    uint16_t nPrimitives;  // 0 -> interior node
+    uint8_t axis;          // interior node: xyz
+    uint8_t pad[1];        // ensure 32 byte total size
 
-    Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
-    bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    Bounds3 bounds() const
+    {
+        Bounds3 b;
+        b.pMin = Vector3f(pMin[0], pMin[1], pMin[2]);
+        b.pMax = Vector3f(pMax[0], pMax[1], pMax[2]);
+        return b;
+    }
 
-    // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    void setBounds(const Bounds3& b)
+    {
+        pMin[0] = b.pMin.x, pMin[1] = b.pMin.y, pMin[2] = b.pMin.z;
+        pMax[0] = b.pMax.x, pMax[1] = b.pMax.y, pMax[2] = b.pMax.z;
+    }
 
-    // BVHAccel Private Data
-    const int maxPrimsInNode;
-    const SplitMethod splitMethod;
-    std::vector<Object*> primitives;
+    bool IntersectP(const Ray& ray, const Vector3f& invDir, const std::array<int, 3>& dirIsNeg, float rayTMax) const
+    {
+#if RAYTRACING_SIMD_VECTOR
+        // the loads take the next float along as a fourth lane, which the slab test leaves
+        // out; it is cleared so that offsets read as floats cannot be denormals
+        (void)dirIsNeg;
+        const __m128 xyz = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+        return Bounds3::IntersectP(_mm_and_ps(_mm_loadu_ps(pMin), xyz), _mm_and_ps(_mm_loadu_ps(pMax), xyz), ray,
+                                   invDir, rayTMax);
+#else
+        return bounds().IntersectP(ray, invDir, dirIsNeg, rayTMax);
+#endif
+    }
 };
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
 
 struct BVHBuildNode {
     Bounds3 bounds;
@@ -62,7 +80,49 @@ public:
     }
 };
 
+// BVHAccel Declarations
+inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
+class BVHAccel {
+
+public:
+    // BVHAccel Public Types
+    enum class SplitMethod { NAIVE, SAH, LBVH };
 
+    // BVHAccel Public Methods
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    Bounds3 WorldBound() const;
+    ~BVHAccel();
 
+    Intersection Intersect(const Ray &ray) const;
+    bool IntersectP(const Ray &ray) const;
+    BVHBuildNode* root = nullptr;
+
+    // BVHAccel Private Methods
+    BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& info, int start, int end);
+    int partitionSAH(std::vector<BVHPrimitiveInfo>& info, int start, int end, const Bounds3& bounds,
+                     const Bounds3& centroidBounds, int& splitAxis, double& cost) const;
+    BVHBuildNode* buildLBVH(std::vector<BVHPrimitiveInfo>& info);
+    BVHBuildNode* emitLBVH(const std::vector<BVHPrimitiveInfo>& info, const std::vector<uint32_t>& codes,
+                           int start, int end);
+    void initLeaf(BVHBuildNode* node, const std::vector<BVHPrimitiveInfo>& info, int start, int end,
+                  const Bounds3& bounds) const;
+    double SAHCost() const;
+    double SAHCost(BVHBuildNode* node) const;
+    int totalNodes(BVHBuildNode* node) const;
+    int flattenBVHTree(BVHBuildNode* node);
+    void updateStackSize();
+    // traversal stack entries kept on the call stack; deeper trees use a heap allocated one
+    static constexpr int kLocalStackSize = 64;
+
+    // BVHAccel Private Data
+    const int maxPrimsInNode;
+    const SplitMethod splitMethod;
+    std::vector<Object*> primitives; // in the order of the leaves after the build
+    std::vector<LinearBVHNode> nodes;
+    // entries the traversal stack may need: each interior node on a path pushes one
+    int stackSize = 1;
+    // the build tree (root), freed in one step once it is flattened
+    MemoryArena<BVHBuildNode> buildNodes;
+};
 
 #endif //RAYTRACING_BVH_H
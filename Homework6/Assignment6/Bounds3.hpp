@@ -13,19 +13,13 @@ class Bounds3
 {
   public:
     Vector3f pMin, pMax; // two points to specify the bounding box
+    // empty: the union with anything is that thing
     Bounds3()
+        : pMin(std::numeric_limits<float>::infinity()), pMax(-std::numeric_limits<float>::infinity())
     {
-        double minNum = std::numeric_limits<double>::lowest();
-        double maxNum = std::numeric_limits<double>::max();
-        pMax = Vector3f(minNum, minNum, minNum);
-        pMin = Vector3f(maxNum, maxNum, maxNum);
     }
     Bounds3(const Vector3f p) : pMin(p), pMax(p) {}
-    Bounds3(const Vector3f p1, const Vector3f p2)
-    {
-        pMin = Vector3f(fmin(p1.x, p2.x), fmin(p1.y, p2.y), fmin(p1.z, p2.z));
-        pMax = Vector3f(fmax(p1.x, p2.x), fmax(p1.y, p2.y), fmax(p1.z, p2.z));
-    }
+    Bounds3(const Vector3f p1, const Vector3f p2) : pMin(Vector3f::Min(p1, p2)), pMax(Vector3f::Max(p1, p2)) {}
 
     Vector3f Diagonal() const { return pMax - pMin; }
     int maxExtent() const
@@ -39,24 +33,27 @@ class Bounds3
             return 2;
     }
 
-    double SurfaceArea() const
+    float SurfaceArea() const
     {
         Vector3f d = Diagonal();
         return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
     }
 
-    Vector3f Centroid() { return 0.5 * pMin + 0.5 * pMax; }
-    Bounds3 Intersect(const Bounds3& b)
+    Vector3f Centroid() const { return 0.5f * pMin + 0.5f * pMax; }
+    Bounds3 Intersect(const Bounds3& b) const
     {
-        return Bounds3(Vector3f(fmax(pMin.x, b.pMin.x), fmax(pMin.y, b.pMin.y),
-                                fmax(pMin.z, b.pMin.z)),
-                       Vector3f(fmin(pMax.x, b.pMax.x), fmin(pMax.y, b.pMax.y),
-                                fmin(pMax.z, b.pMax.z)));
+        return Bounds3(Vector3f::Max(pMin, b.pMin), Vector3f::Min(pMax, b.pMax));
     }
 
     Vector3f Offset(const Vector3f& p) const
     {
         Vector3f o = p - pMin;
+#if RAYTRACING_SIMD_VECTOR
+        // divide the axes along which the box is not flat
+        __m128 flat = _mm_cmple_ps(pMax.simd(), pMin.simd());
+        __m128 scaled = _mm_div_ps(o.simd(), _mm_sub_ps(pMax.simd(), pMin.simd()));
+        return Vector3f(_mm_or_ps(_mm_and_ps(flat, o.simd()), _mm_andnot_ps(flat, scaled)));
+#else
         if (pMax.x > pMin.x)
             o.x /= pMax.x - pMin.x;
         if (pMax.y > pMin.y)
@@ -64,20 +61,31 @@ class Bounds3
         if (pMax.z > pMin.z)
             o.z /= pMax.z - pMin.z;
         return o;
+#endif
     }
 
-    bool Overlaps(const Bounds3& b1, const Bounds3& b2)
+    bool Overlaps(const Bounds3& b1, const Bounds3& b2) const
     {
+#if RAYTRACING_SIMD_VECTOR
+        __m128 overlap = _mm_and_ps(_mm_cmpge_ps(b1.pMax.simd(), b2.pMin.simd()), _mm_cmple_ps(b1.pMin.simd(), b2.pMax.simd()));
+        return (_mm_movemask_ps(overlap) & 7) == 7;
+#else
         bool x = (b1.pMax.x >= b2.pMin.x) && (b1.pMin.x <= b2.pMax.x);
         bool y = (b1.pMax.y >= b2.pMin.y) && (b1.pMin.y <= b2.pMax.y);
         bool z = (b1.pMax.z >= b2.pMin.z) && (b1.pMin.z <= b2.pMax.z);
         return (x && y && z);
+#endif
     }
 
-    bool Inside(const Vector3f& p, const Bounds3& b)
+    bool Inside(const Vector3f& p, const Bounds3& b) const
     {
+#if RAYTRACING_SIMD_VECTOR
+        __m128 inside = _mm_and_ps(_mm_cmpge_ps(p.simd(), b.pMin.simd()), _mm_cmple_ps(p.simd(), b.pMax.simd()));
+        return (_mm_movemask_ps(inside) & 7) == 7;
+#else
         return (p.x >= b.pMin.x && p.x <= b.pMax.x && p.y >= b.pMin.y &&
                 p.y <= b.pMax.y && p.z >= b.pMin.z && p.z <= b.pMax.z);
+#endif
     }
     inline const Vector3f& operator[](int i) const
     {
@@ -85,17 +93,26 @@ class Bounds3
     }
 
     inline bool IntersectP(const Ray& ray, const Vector3f& invDir,
-                           const std::array<int, 3>& dirisNeg) const;
+                           const std::array<int, 3>& dirisNeg,
+                           float rayTMax = std::numeric_limits<float>::infinity()) const;
+#if RAYTRACING_SIMD_VECTOR
+    // IntersectP of the box with corners lo and hi (x, y, z in the low lanes), for boxes
+    // stored as plain floats (see LinearBVHNode)
+    static inline bool IntersectP(__m128 lo, __m128 hi, const Ray& ray, const Vector3f& invDir, float rayTMax);
+#endif
 };
 
 
 
 inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
-                                const std::array<int, 3>& dirIsNeg) const
+                                const std::array<int, 3>& dirIsNeg, float rayTMax) const
 {
     // invDir: ray direction(x,y,z), invDir=(1.0/x,1.0/y,1.0/z), use this because Multiply is faster that Division
     // dirIsNeg: ray direction(x,y,z), dirIsNeg=[int(x>0),int(y>0),int(z>0)], use this to simplify your logic
-    // TODO test if ray bound intersects
+#if RAYTRACING_SIMD_VECTOR
+    (void)dirIsNeg;
+    return IntersectP(pMin.simd(), pMax.simd(), ray, invDir, rayTMax);
+#else
     auto swap = [](float& a, float& b) {
         float tmp = a;
         a = b;
@@ -106,8 +123,34 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir,
     if (dirIsNeg[1]) swap(tMin.y, tMax.y);
     if (dirIsNeg[2]) swap(tMin.z, tMax.z);
     float tEnter = fmax(fmax(tMin.x, tMin.y), tMin.z), tExit = fmin(fmin(tMax.x, tMax.y), tMax.z);
-    return tEnter < tExit && tExit > 0;
+    return tEnter < tExit && tExit > 0 && tEnter < rayTMax;
+#endif
+}
+
+#if RAYTRACING_SIMD_VECTOR
+inline bool Bounds3::IntersectP(__m128 lo, __m128 hi, const Ray& ray, const Vector3f& invDir, float rayTMax)
+{
+    // [comment]
+    // Branchless slab test: the near and far distances of each slab are the min and max of
+    // its two planes' distances, which does not need dirIsNeg. A ray in the plane of a face
+    // gets 0 * inf = NaN there; that axis is set to NaN on both sides and then left out of
+    // the reductions, as fmax and fmin leave it out in the scalar version (maxss and minss
+    // return their second operand when the first is NaN). Only lanes x, y and z are reduced.
+    // [/comment]
+    const __m128 t0 = _mm_mul_ps(_mm_sub_ps(lo, ray.origin.simd()), invDir.simd());
+    const __m128 t1 = _mm_mul_ps(_mm_sub_ps(hi, ray.origin.simd()), invDir.simd());
+    const __m128 nan = _mm_cmpunord_ps(t0, t1);
+    const __m128 tNear = _mm_or_ps(_mm_min_ps(t0, t1), nan), tFar = _mm_or_ps(_mm_max_ps(t0, t1), nan);
+    __m128 enter = _mm_max_ss(tNear, _mm_set_ss(-std::numeric_limits<float>::infinity()));
+    enter = _mm_max_ss(_mm_shuffle_ps(tNear, tNear, _MM_SHUFFLE(1, 1, 1, 1)), enter);
+    enter = _mm_max_ss(_mm_movehl_ps(tNear, tNear), enter);
+    __m128 exit = _mm_min_ss(tFar, _mm_set_ss(std::numeric_limits<float>::infinity()));
+    exit = _mm_min_ss(_mm_shuffle_ps(tFar, tFar, _MM_SHUFFLE(1, 1, 1, 1)), exit);
+    exit = _mm_min_ss(_mm_movehl_ps(tFar, tFar), exit);
+    const float tEnter = _mm_cvtss_f32(enter), tExit = _mm_cvtss_f32(exit);
+    return (tEnter < tExit) & (tExit > 0) & (tEnter < rayTMax);
 }
+#endif
 
 inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
 {
@@ -0,0 +1,46 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// [comment]
+// Bump allocator for objects of one type that all live as long as their owner, like the
+// nodes of a BVH build. Objects are handed out from contiguous blocks of blockSize, and
+// released all at once when the arena is cleared or destroyed, instead of one delete
+// per object. alloc() may be called from several threads (the build tasks).
+// [/comment]
+template <typename T>
+class MemoryArena
+{
+public:
+    explicit MemoryArena(size_t blockSize = 4096) : blockSize(blockSize) {}
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+
+    T* alloc()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (blocks.empty() || used == blockSize) {
+            blocks.emplace_back(new T[blockSize]);
+            used = 0;
+        }
+        return &blocks.back()[used++];
+    }
+
+    void clear()
+    {
+        blocks.clear();
+        used = 0;
+    }
+
+    // Number of objects allocated, and bytes held by the blocks
+    size_t size() const { return blocks.empty() ? 0 : (blocks.size() - 1) * blockSize + used; }
+    size_t bytes() const { return blocks.size() * blockSize * sizeof(T); }
+
+private:
+    const size_t blockSize;
+    std::vector<std::unique_ptr<T[]>> blocks;
+    size_t used = 0;
+    std::mutex mutex;
+};
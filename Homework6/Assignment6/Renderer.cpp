@@ -5,6 +5,7 @@
 #include <fstream>
 #include "Scene.hpp"
 #include "Renderer.hpp"
+#include "ImageWriter.hpp"
 
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
@@ -22,6 +23,9 @@ void Renderer::Render(const Scene& scene)
     float imageAspectRatio = scene.width / (float)scene.height;
     Vector3f eye_pos(-1, 5, 10);
     int m = 0;
+
+    // rows are saved to the file as soon as they are finished
+    ImageWriter writer(outputFile, scene.width, scene.height);
     for (uint32_t j = 0; j < scene.height; ++j) {
         for (uint32_t i = 0; i < scene.width; ++i) {
             // generate primary ray direction
@@ -36,19 +40,10 @@ void Renderer::Render(const Scene& scene)
             Vector3f dir = normalize(Vector3f(x, y, -1));
             framebuffer[m++] = scene.castRay(Ray(eye_pos, dir), 0);
         }
+        writer.writeRows(j, 1, &framebuffer[j * scene.width]);
         UpdateProgress(j / (float)scene.height);
     }
     UpdateProgress(1.f);
 
-    // save framebuffer to file
-    FILE* fp = fopen("binary.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    for (auto i = 0; i < scene.height * scene.width; ++i) {
-        static unsigned char color[3];
-        color[0] = (unsigned char)(255 * clamp(0, 1, framebuffer[i].x));
-        color[1] = (unsigned char)(255 * clamp(0, 1, framebuffer[i].y));
-        color[2] = (unsigned char)(255 * clamp(0, 1, framebuffer[i].z));
-        fwrite(color, 1, 3, fp);
-    }
-    fclose(fp);    
+    writer.close();
 }
@@ -1,6 +1,7 @@
 //
 // Created by goksu on 2/25/20.
 //
+#include <string>
 #include "Scene.hpp"
 
 #pragma once
@@ -17,5 +18,8 @@ class Renderer
 public:
     void Render(const Scene& scene);
 
+    // The format is picked from the extension: .ppm, .png, .pfm or .exr (half float)
+    std::string outputFile = "binary.ppm";
+
 private:
 };
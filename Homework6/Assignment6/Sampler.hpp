@@ -0,0 +1,186 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// [comment]
+// PCG32 (O'Neill, pcg-random.org): 64 bits of state, 32-bit output, and a selectable
+// stream so that every thread or pixel can get its own independent sequence.
+// [/comment]
+class PCG32
+{
+public:
+    PCG32(uint64_t initState = 0x853c49e6748fea9bULL, uint64_t initSeq = 0xda3e39cb94b95bdbULL)
+    {
+        seed(initState, initSeq);
+    }
+
+    void seed(uint64_t initState, uint64_t initSeq = 1)
+    {
+        state = 0;
+        inc = (initSeq << 1) | 1;
+        nextUInt();
+        state += initState;
+        nextUInt();
+    }
+
+    uint32_t nextUInt()
+    {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+        uint32_t rot = uint32_t(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+    // uniform in [0, 1)
+    float nextFloat() { return (nextUInt() >> 8) * 0x1p-24f; }
+
+private:
+    uint64_t state, inc;
+};
+
+enum class SampleMode
+{
+    Random,     // independent PCG32 numbers
+    Stratified, // every dimension split into spp jittered strata, shuffled per pixel
+    Halton      // Halton sequence, digits scrambled per pixel
+};
+
+// [comment]
+// Source of the random numbers used while rendering. Each thread owns one sampler
+// (Sampler::current(), which is what get_random_float() draws from). The renderer calls
+// startPixel() and startSample() so that the numbers only depend on the pixel and the
+// sample index, which makes renders reproducible whatever the thread scheduling is, and
+// lets the samples of a pixel be taken in separate passes.
+// Every get1D() call inside a sample consumes the next dimension; the stratified and
+// Halton patterns cover the first kMaxDimension dimensions, later ones are random.
+// [/comment]
+class Sampler
+{
+public:
+    static constexpr int kMaxDimension = 16;
+
+    Sampler() : rng(0, nextStream()) {}
+
+    // Sampler of the calling thread
+    static Sampler& current()
+    {
+        static thread_local Sampler sampler;
+        return sampler;
+    }
+
+    void setup(SampleMode m, int samplesPerPixel, uint64_t s = 0)
+    {
+        mode = m;
+        spp = samplesPerPixel > 0 ? samplesPerPixel : 1;
+        seed = s;
+    }
+
+    SampleMode getMode() const { return mode; }
+
+    void startPixel(int x, int y)
+    {
+        pixelSeed = mix(seed ^ mix((uint64_t(uint32_t(y)) << 32) | uint32_t(x)));
+        startSample(0);
+    }
+
+    void startSample(int index)
+    {
+        sampleIndex = uint32_t(index);
+        dimension = 0;
+        rng.seed(mix(pixelSeed + sampleIndex * 0xd1b54a32d192ed03ULL), seed);
+    }
+
+    float get1D()
+    {
+        int d = dimension++;
+        if (mode == SampleMode::Random || d >= kMaxDimension)
+            return rng.nextFloat();
+        uint64_t h = mix(pixelSeed + uint64_t(d) * 0x9e3779b97f4a7c15ULL);
+        if (mode == SampleMode::Stratified) {
+            uint32_t stratum = permute(sampleIndex % uint32_t(spp), uint32_t(spp), uint32_t(h));
+            return clampBelowOne((stratum + rng.nextFloat()) / spp);
+        }
+        return clampBelowOne(scrambledRadicalInverse(kPrimes[d], sampleIndex, h));
+    }
+
+private:
+    static constexpr uint32_t kPrimes[kMaxDimension] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53};
+
+    static uint64_t nextStream()
+    {
+        static std::atomic<uint64_t> streams{0};
+        return streams++;
+    }
+
+    // splitmix64 finalizer
+    static uint64_t mix(uint64_t v)
+    {
+        v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+        return v ^ (v >> 31);
+    }
+
+    static float clampBelowOne(float v) { return v < 0x1.fffffep-1f ? v : 0x1.fffffep-1f; }
+
+    // Radical inverse of i with each digit sent through a random permutation picked from
+    // h. The digits that tell the spp samples of a pixel apart are permuted, the finer
+    // ones are replaced by a uniform jitter (equivalent in distribution, and cheaper).
+    // This keeps the stratification of the Halton points and breaks the correlation
+    // between the large prime bases for the first few sample indices.
+    float scrambledRadicalInverse(uint32_t base, uint32_t i, uint64_t h) const
+    {
+        float invBase = 1.f / base, f = 1.f, v = 0.f;
+        for (uint32_t rest = i > uint32_t(spp - 1) ? i : uint32_t(spp - 1); rest; rest /= base) {
+            uint32_t next = i / base;
+            uint32_t digit = i - next * base;
+            h = h * 6364136223846793005ULL + 1442695040888963407ULL;
+            f *= invBase;
+            v += permute(digit, base, uint32_t(h >> 32)) * f;
+            i = next;
+        }
+        h = mix(h);
+        return v + f * ((h >> 40) * 0x1p-24f);
+    }
+
+    // Random permutation of [0, l) selected by p, without a table (Kensler, "Correlated
+    // Multi-Jittered Sampling", 2013)
+    static uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+    {
+        uint32_t w = l - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do {
+            i ^= p;
+            i *= 0xe170893d;
+            i ^= p >> 16;
+            i ^= (i & w) >> 4;
+            i ^= p >> 8;
+            i *= 0x0929eb3f;
+            i ^= p >> 23;
+            i ^= (i & w) >> 1;
+            i *= 1 | p >> 27;
+            i *= 0x6935fa69;
+            i ^= (i & w) >> 11;
+            i *= 0x74dcb303;
+            i ^= (i & w) >> 2;
+            i *= 0x9e501cc3;
+            i ^= (i & w) >> 2;
+            i *= 0xc860a3df;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= l);
+        return (i + p) % l;
+    }
+
+    PCG32 rng;
+    SampleMode mode = SampleMode::Random;
+    int spp = 1;
+    uint64_t seed = 0;
+    uint64_t pixelSeed = 0;
+    uint32_t sampleIndex = 0;
+    int dimension = 0;
+};
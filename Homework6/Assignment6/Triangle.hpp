@@ -3,7 +3,8 @@
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
+#include "MeshCache.hpp"
+#include "OBJ_Parser.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
 #include <cassert>
@@ -75,13 +76,18 @@ public:
 class MeshTriangle : public Object
 {
 public:
-    MeshTriangle(const std::string& filename)
+    MeshTriangle(const std::string& filename, BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH)
     {
-        objl::Loader loader;
-        loader.LoadFile(filename);
+        MeshCache::Key key;
+        bool cacheable = MeshCache::hashFile(filename, key);
+        key.params[0] = int32_t(splitMethod);
+        if (cacheable && loadCache(MeshCache::path(filename), key, splitMethod))
+            return;
 
-        assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
+        objp::Mesh mesh;
+        objp::LoadFile(filename, mesh);
+
+        assert(!mesh.indices.empty());
 
         Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
                                      std::numeric_limits<float>::infinity(),
@@ -89,13 +95,11 @@ public:
         Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity(),
                                      -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
+        for (size_t i = 0; i < mesh.indices.size(); i += 3) {
             std::array<Vector3f, 3> face_vertices;
             for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z) *
-                            60.f;
+                const float* p = &mesh.positions[3 * mesh.indices[i + j]];
+                auto vert = Vector3f(p[0], p[1], p[2]) * 60.f;
                 face_vertices[j] = vert;
 
                 min_vert = Vector3f(std::min(min_vert.x, vert.x),
@@ -106,15 +110,8 @@ public:
                                     std::max(max_vert.z, vert.z));
             }
 
-            auto new_mat =
-                new Material(MaterialType::DIFFUSE_AND_GLOSSY,
-                             Vector3f(0.5, 0.5, 0.5), Vector3f(0, 0, 0));
-            new_mat->Kd = 0.6;
-            new_mat->Ks = 0.0;
-            new_mat->specularExponent = 0;
-
             triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], new_mat);
+                                   face_vertices[2], faceMaterial());
         }
 
         bounding_box = Bounds3(min_vert, max_vert);
@@ -123,7 +120,66 @@ public:
         for (auto& tri : triangles)
             ptrs.push_back(&tri);
 
-        bvh = new BVHAccel(ptrs);
+        bvh.reset(new BVHAccel(ptrs, 1, splitMethod));
+        if (cacheable)
+            saveCache(MeshCache::path(filename), key);
+    }
+
+    static Material* faceMaterial()
+    {
+        auto new_mat =
+            new Material(MaterialType::DIFFUSE_AND_GLOSSY,
+                         Vector3f(0.5, 0.5, 0.5), Vector3f(0, 0, 0));
+        new_mat->Kd = 0.6;
+        new_mat->Ks = 0.0;
+        new_mat->specularExponent = 0;
+        return new_mat;
+    }
+
+    // Version of the layout of the cache files written by saveCache
+    static constexpr uint32_t kCacheVersion = 1;
+
+    // [comment]
+    // Loads the triangles, in the order of the BVH leaves, and the flattened BVH from the
+    // cache at path, if it was written for the same source file and build parameters.
+    // [/comment]
+    bool loadCache(const std::string& path, const MeshCache::Key& key, BVHAccel::SplitMethod splitMethod)
+    {
+        MeshCache cache;
+        if (!cache.open(path, kCacheVersion, key))
+            return false;
+        size_t nCorners = 0, nNodes = 0, nBounds = 0;
+        const Vector3f* corners = cache.array<Vector3f>(nCorners);
+        const LinearBVHNode* nodes = cache.array<LinearBVHNode>(nNodes);
+        const Bounds3* bounds = cache.array<Bounds3>(nBounds);
+        if (!corners || !nodes || !bounds || nBounds != 1)
+            return false;
+
+        triangles.reserve(nCorners / 3);
+        for (size_t i = 0; i + 2 < nCorners; i += 3)
+            triangles.emplace_back(corners[i], corners[i + 1], corners[i + 2], faceMaterial());
+        bounding_box = bounds[0];
+
+        bvh.reset(new BVHAccel({}, 1, splitMethod));
+        for (auto& tri : triangles)
+            bvh->primitives.push_back(&tri);
+        bvh->nodes.assign(nodes, nodes + nNodes);
+        bvh->updateStackSize();
+        return true;
+    }
+
+    void saveCache(const std::string& path, const MeshCache::Key& key) const
+    {
+        std::vector<Vector3f> corners;
+        for (auto object : bvh->primitives) {
+            auto tri = static_cast<const Triangle*>(object);
+            corners.insert(corners.end(), {tri->v0, tri->v1, tri->v2});
+        }
+        MeshCache cache;
+        cache.add(corners.data(), corners.size());
+        cache.add(bvh->nodes.data(), bvh->nodes.size());
+        cache.add(&bounding_box, 1);
+        cache.save(path, kCacheVersion, key);
     }
 
     bool intersect(const Ray& ray) { return true; }
@@ -194,7 +250,7 @@ public:
 
     std::vector<Triangle> triangles;
 
-    BVHAccel* bvh;
+    std::unique_ptr<BVHAccel> bvh;
 
     Material* m;
 };
@@ -21,6 +21,8 @@ int main(int argc, char** argv)
     scene.buildBVH();
 
     Renderer r;
+    if (argc > 1)
+        r.outputFile = argv[1];
 
     auto start = std::chrono::system_clock::now();
     r.Render(scene);
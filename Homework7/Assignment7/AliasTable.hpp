@@ -0,0 +1,72 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+
+// [comment]
+// Walker's alias method (Vose's construction): picks index i with probability
+// weights[i] / sum(weights) in O(1). Every bin holds the probability of keeping its
+// own index and the index to switch to otherwise, so a sample costs one table lookup
+// and one comparison whatever the number of entries.
+// [/comment]
+class AliasTable
+{
+public:
+    AliasTable() = default;
+
+    explicit AliasTable(const std::vector<float>& weights)
+    {
+        int n = weights.size();
+        double sum = 0;
+        for (float w : weights)
+            sum += w;
+        if (n == 0 || sum <= 0)
+            return;
+
+        bins.resize(n);
+        std::vector<double> scaled(n);
+        std::vector<int> small, large;
+        for (int i = 0; i < n; ++i) {
+            bins[i].pmf = float(weights[i] / sum);
+            scaled[i] = weights[i] / sum * n;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            int s = small.back(), l = large.back();
+            small.pop_back();
+            bins[s].q = float(scaled[s]);
+            bins[s].alias = l;
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        // whatever is left is 1 up to rounding
+        for (int i : large)
+            bins[i].q = 1, bins[i].alias = i;
+        for (int i : small)
+            bins[i].q = 1, bins[i].alias = i;
+    }
+
+    bool empty() const { return bins.empty(); }
+    int size() const { return bins.size(); }
+    float pmf(int i) const { return bins[i].pmf; }
+
+    // u in [0, 1) selects the bin and, through its fractional part, the coin flip
+    int sample(float u) const
+    {
+        int n = bins.size();
+        float x = u * n;
+        int i = std::min(int(x), n - 1);
+        return x - i < bins[i].q ? i : bins[i].alias;
+    }
+
+private:
+    struct Bin
+    {
+        float q = 1;   // probability of keeping i
+        int alias = 0; // index used otherwise
+        float pmf = 0;
+    };
+    std::vector<Bin> bins;
+};
@@ -1,135 +1,734 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include "BVH.hpp"
 
+// Bounds and centroid of a primitive, computed once before the build
+struct BVHPrimitiveInfo {
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(int primitiveNumber, const Bounds3& bounds)
+        : primitiveNumber(primitiveNumber), bounds(bounds), centroid(0.5 * bounds.pMin + 0.5 * bounds.pMax) {}
+    int primitiveNumber;
+    Bounds3 bounds;
+    Vector3f centroid;
+};
+
+// ranges smaller than this are built by the task that reaches them
+static constexpr int kParallelBuildThreshold = 4096;
+
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
-                   SplitMethod splitMethod)
+                   SplitMethod splitMethod, int leafWidth)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
-      primitives(std::move(p))
+      leafWidth(std::max(1, leafWidth)), primitives(std::move(p))
 {
-    time_t start, stop;
-    time(&start);
+    auto start = std::chrono::steady_clock::now();
     if (primitives.empty())
         return;
 
-    root = recursiveBuild(primitives);
+    // [comment]
+    // The builders reorder info within the range of each node, so that in the end the
+    // leaves cover consecutive ranges of it and primitives can be put in the same order.
+    // Subtrees are built as OpenMP tasks.
+    // [/comment]
+    int n = int(primitives.size());
+    std::vector<BVHPrimitiveInfo> info(n);
+    #pragma omp parallel for
+    for (int i = 0; i < n; ++i)
+        info[i] = BVHPrimitiveInfo(i, primitives[i]->getBounds());
+
+    #pragma omp parallel
+    #pragma omp single
+    root = splitMethod == SplitMethod::LBVH ? buildLBVH(info) : recursiveBuild(info, 0, n);
+
+    std::vector<Object*> ordered(n);
+    for (int i = 0; i < n; ++i)
+        ordered[i] = primitives[info[i].primitiveNumber];
+    primitives.swap(ordered);
+    nodes.reserve(totalNodes(root));
+    flattenBVHTree(root);
+    collapse(0);
+    updateStackSize();
+    std::vector<LinearBVHNode>().swap(nodes);
+    builtSAHCost = wideSAHCost();
+
+    // the build tree is not needed any more, and its leaves may point to primitives that
+    // the caller frees (see MeshTriangle::buildBVH)
+    double cost = SAHCost();
+    root = nullptr;
+    buildNodes.clear();
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("\rBVH Generation complete: \nTime Taken: %.2f ms (%d primitives)\nSAH cost: %.2f\n\n", ms, n, cost);
+}
+
+BVHAccel::~BVHAccel() = default;
 
-    time(&stop);
-    double diff = difftime(stop, start);
-    int hrs = (int)diff / 3600;
-    int mins = ((int)diff / 60) - (hrs * 60);
-    int secs = (int)diff - (hrs * 3600) - (mins * 60);
+Bounds3 BVHAccel::WorldBound() const
+{
+    Bounds3 bounds;
+    if (!wideNodes.empty())
+        for (int i = 0; i < WideBVHNode::kWidth; ++i)
+            if (wideNodes[0].child[i] >= 0)
+                bounds = Union(bounds, wideNodes[0].bounds(i));
+    return bounds;
+}
 
-    printf(
-        "\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n",
-        hrs, mins, secs);
+// Makes node a leaf holding info[start, end)
+void BVHAccel::initLeaf(BVHBuildNode* node, const std::vector<BVHPrimitiveInfo>& info, int start, int end,
+                        const Bounds3& bounds) const
+{
+    node->bounds = bounds;
+    node->object = primitives[info[start].primitiveNumber];
+    node->left = nullptr;
+    node->right = nullptr;
+    node->firstPrimOffset = start;
+    node->nPrimitives = end - start;
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& info, int start, int end)
 {
-    BVHBuildNode* node = new BVHBuildNode();
+    BVHBuildNode* node = buildNodes.alloc();
 
     // Compute bounds of all primitives in BVH node
-    Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
-        // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
-        node->left = nullptr;
-        node->right = nullptr;
-        node->area = objects[0]->getArea();
+    Bounds3 bounds, centroidBounds;
+    for (int i = start; i < end; ++i) {
+        bounds = Union(bounds, info[i].bounds);
+        centroidBounds = Union(centroidBounds, info[i].centroid);
+    }
+    int n = end - start;
+    if (n == 1) {
+        initLeaf(node, info, start, end, bounds);
         return node;
     }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
 
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
+    int dim = centroidBounds.maxExtent();
+    int mid = end;
+    double splitCost = std::numeric_limits<double>::max();
+    if (splitMethod == SplitMethod::SAH)
+        mid = partitionSAH(info, start, end, bounds, centroidBounds, dim, splitCost);
+
+    // keep small sets together when intersecting all of them is cheaper
+    if (n <= maxPrimsInNode && leafCost(n) <= splitCost) {
+        initLeaf(node, info, start, end, bounds);
         return node;
     }
-    else {
-        Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
-            centroidBounds =
-                Union(centroidBounds, objects[i]->getBounds().Centroid());
-        int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                       f2->getBounds().Centroid().x;
-            });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                       f2->getBounds().Centroid().y;
-            });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                       f2->getBounds().Centroid().z;
-            });
-            break;
-        }
-
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
-
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
-
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
-
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
-
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
+
+    if (mid == start || mid == end) {
+        // NAIVE, or SAH found no useful split: cut at the median along the largest extent
+        mid = start + n / 2;
+        std::nth_element(info.begin() + start, info.begin() + mid, info.begin() + end,
+                         [dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+                             return a.centroid[dim] < b.centroid[dim];
+                         });
     }
+    node->splitAxis = dim;
 
+    #pragma omp task shared(info) if(n > kParallelBuildThreshold)
+    node->left = recursiveBuild(info, start, mid);
+    node->right = recursiveBuild(info, mid, end);
+    #pragma omp taskwait
+
+    node->bounds = bounds;
     return node;
 }
 
+// Binned SAH split. The primitive centroids are sorted into nBuckets buckets along each
+// axis, and info[start, end) is partitioned at the bucket boundary with the lowest estimated cost
+//     C = C_trav + (leafCost(N_left) * SA(left) + leafCost(N_right) * SA(right)) / SA(node)
+// Returns end if there is no boundary to split at (all centroids fall in one bucket),
+// otherwise the start of the right part, and sets splitAxis to the axis of the split and
+// cost to its estimated cost.
+int BVHAccel::partitionSAH(std::vector<BVHPrimitiveInfo>& info, int start, int end, const Bounds3& bounds,
+                           const Bounds3& centroidBounds, int& splitAxis, double& cost) const
+{
+    constexpr int nBuckets = 16;
+    constexpr double traversalCost = 0.125; // relative to one primitive intersection
+
+    auto bucketOf = [&](const BVHPrimitiveInfo& p, int dim) {
+        const Vector3f offset = centroidBounds.Offset(p.centroid);
+        int k = int(nBuckets * offset[dim]);
+        return std::min(std::max(k, 0), nBuckets - 1);
+    };
+
+    double bestCost = std::numeric_limits<double>::max();
+    int bestDim = -1, bestSplit = -1;
+    for (int dim = 0; dim < 3; ++dim) {
+        if (centroidBounds.pMax[dim] <= centroidBounds.pMin[dim])
+            continue;
+
+        int count[nBuckets] = {};
+        Bounds3 bucketBounds[nBuckets];
+        for (int i = start; i < end; ++i) {
+            int b = bucketOf(info[i], dim);
+            ++count[b];
+            bucketBounds[b] = Union(bucketBounds[b], info[i].bounds);
+        }
+
+        // sweep from the right to get the area and count above every boundary
+        double rightArea[nBuckets - 1];
+        int rightCount[nBuckets - 1];
+        Bounds3 right;
+        int n = 0;
+        for (int b = nBuckets - 1; b > 0; --b) {
+            right = Union(right, bucketBounds[b]);
+            n += count[b];
+            rightArea[b - 1] = n > 0 ? right.SurfaceArea() : 0;
+            rightCount[b - 1] = n;
+        }
+
+        Bounds3 left;
+        n = 0;
+        for (int b = 0; b < nBuckets - 1; ++b) {
+            left = Union(left, bucketBounds[b]);
+            n += count[b];
+            if (n == 0 || rightCount[b] == 0)
+                continue;
+            double cost = traversalCost + (leafCost(n) * left.SurfaceArea() +
+                                           leafCost(rightCount[b]) * rightArea[b]) / bounds.SurfaceArea();
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestDim = dim;
+                bestSplit = b;
+            }
+        }
+    }
+
+    if (bestDim < 0)
+        return end;
+    splitAxis = bestDim;
+    cost = bestCost;
+    return int(std::partition(info.begin() + start, info.begin() + end, [&](const BVHPrimitiveInfo& p) {
+        return bucketOf(p, bestDim) <= bestSplit;
+    }) - info.begin());
+}
+
+// [comment]
+// Linear BVH (Lauterbach et al., "Fast BVH Construction on GPUs", 2009): the primitives
+// are sorted along the Morton curve of their centroids (30-bit codes, radix sorted), and
+// every node splits its range where the highest bit in which its codes differ turns to
+// 1. Much faster to build than SAH, at the price of a worse tree.
+// [/comment]
+BVHBuildNode* BVHAccel::buildLBVH(std::vector<BVHPrimitiveInfo>& info)
+{
+    int n = int(info.size());
+    Bounds3 centroidBounds;
+    for (const auto& p : info)
+        centroidBounds = Union(centroidBounds, p.centroid);
+
+    std::vector<uint32_t> codes(n), sortedCodes(n);
+    #pragma omp taskloop shared(info, codes, centroidBounds)
+    for (int i = 0; i < n; ++i) {
+        codes[i] = mortonCode(centroidBounds.Offset(info[i].centroid));
+    }
+
+    // LSD radix sort of the codes with the indices of their primitives, 10 bits per pass;
+    // the (larger) primitive infos are moved once, at the end
+    std::vector<int> order(n), sortedOrder(n);
+    for (int i = 0; i < n; ++i)
+        order[i] = i;
+    for (int shift = 0; shift < 30; shift += 10) {
+        std::vector<int> offset(1025, 0);
+        for (uint32_t code : codes)
+            ++offset[((code >> shift) & 1023) + 1];
+        for (int b = 0; b < 1024; ++b)
+            offset[b + 1] += offset[b];
+        for (int i = 0; i < n; ++i) {
+            int k = offset[(codes[i] >> shift) & 1023]++;
+            sortedCodes[k] = codes[i];
+            sortedOrder[k] = order[i];
+        }
+        codes.swap(sortedCodes);
+        order.swap(sortedOrder);
+    }
+    std::vector<BVHPrimitiveInfo> sortedInfo(n);
+    for (int i = 0; i < n; ++i)
+        sortedInfo[i] = info[order[i]];
+    info.swap(sortedInfo);
+
+    return emitLBVH(info, codes, 0, n);
+}
+
+BVHBuildNode* BVHAccel::emitLBVH(const std::vector<BVHPrimitiveInfo>& info, const std::vector<uint32_t>& codes,
+                                 int start, int end)
+{
+    BVHBuildNode* node = buildNodes.alloc();
+    int n = end - start;
+    if (n <= maxPrimsInNode) {
+        Bounds3 bounds;
+        for (int i = start; i < end; ++i)
+            bounds = Union(bounds, info[i].bounds);
+        initLeaf(node, info, start, end, bounds);
+        return node;
+    }
+
+    int mid = start + n / 2;
+    if (uint32_t diff = codes[start] ^ codes[end - 1]) {
+        int bit = 31 - __builtin_clz(diff);
+        mid = int(std::partition_point(codes.begin() + start, codes.begin() + end,
+                                       [bit](uint32_t code) { return !(code >> bit & 1); }) - codes.begin());
+        // bits 3k + 2, 3k + 1 and 3k come from x, y and z
+        node->splitAxis = 2 - bit % 3;
+    }
+
+    #pragma omp task shared(info, codes) if(n > kParallelBuildThreshold)
+    node->left = emitLBVH(info, codes, start, mid);
+    node->right = emitLBVH(info, codes, mid, end);
+    #pragma omp taskwait
+
+    node->bounds = Union(node->left->bounds, node->right->bounds);
+    return node;
+}
+
+// Expected cost of a ray query, relative to one primitive intersection:
+// the sum over the nodes of the probability to visit them (surface area ratio)
+// times their cost (traversal for interior nodes, intersection for leaves).
+double BVHAccel::SAHCost() const
+{
+    if (!root)
+        return 0;
+    return SAHCost(root) / root->bounds.SurfaceArea();
+}
+
+double BVHAccel::SAHCost(BVHBuildNode* node) const
+{
+    if (!node->left && !node->right)
+        return leafCost(node->nPrimitives) * node->bounds.SurfaceArea();
+    return 0.125 * node->bounds.SurfaceArea() + SAHCost(node->left) + SAHCost(node->right);
+}
+
+int BVHAccel::totalNodes(BVHBuildNode* node) const
+{
+    return node ? 1 + totalNodes(node->left) + totalNodes(node->right) : 0;
+}
+
+// SAH cost of the 4-wide tree, the one that is traversed, with the same constants
+double BVHAccel::wideSAHCost() const
+{
+    double rootArea = WorldBound().SurfaceArea();
+    if (rootArea <= 0)
+        return 0;
+    double cost = 0.125 * rootArea;
+    for (const auto& node : wideNodes)
+        for (int i = 0; i < WideBVHNode::kWidth; ++i)
+            if (node.child[i] >= 0)
+                cost += (node.count[i] > 0 ? leafCost(node.count[i]) : 0.125) * node.bounds(i).SurfaceArea();
+    return cost / rootArea;
+}
+
+// Appends the subtree to the node array in depth-first order (the leaves already are in
+// that order in primitives). Returns the index of the subtree root.
+int BVHAccel::flattenBVHTree(BVHBuildNode* node)
+{
+    int offset = int(nodes.size());
+    nodes.emplace_back();
+    nodes[offset].setBounds(node->bounds);
+    if (!node->left && !node->right) {
+        nodes[offset].primitivesOffset = node->firstPrimOffset;
+        nodes[offset].nPrimitives = uint16_t(node->nPrimitives);
+    }
+    else {
+        // the first child directly follows its parent
+        nodes[offset].axis = uint8_t(node->splitAxis);
+        nodes[offset].nPrimitives = 0;
+        flattenBVHTree(node->left);
+        nodes[offset].secondChildOffset = flattenBVHTree(node->right);
+    }
+    return offset;
+}
+
+// [comment]
+// Folds the binary subtree rooted at nodes[node] into 4-wide nodes. Starting from its
+// two children, the interior child with the largest surface area (the one most likely
+// to be entered) is replaced by its own two children until there are kWidth of them.
+// Returns the index of the wide node; its descendants follow it in depth-first order.
+// [/comment]
+int BVHAccel::collapse(int node)
+{
+    constexpr int width = WideBVHNode::kWidth;
+    int children[width], n = 0;
+    if (nodes[node].nPrimitives > 0) {
+        // a single leaf, only at the root
+        children[n++] = node;
+    }
+    else {
+        children[n++] = node + 1;
+        children[n++] = nodes[node].secondChildOffset;
+        while (n < width) {
+            int best = -1;
+            double bestArea = -1;
+            for (int i = 0; i < n; ++i) {
+                const LinearBVHNode& c = nodes[children[i]];
+                if (c.nPrimitives == 0 && c.bounds().SurfaceArea() > bestArea) {
+                    best = i;
+                    bestArea = c.bounds().SurfaceArea();
+                }
+            }
+            if (best < 0)
+                break;
+            int c = children[best];
+            children[best] = c + 1;
+            children[n++] = nodes[c].secondChildOffset;
+        }
+    }
+
+    int offset = int(wideNodes.size());
+    wideNodes.emplace_back();
+    WideBVHNode wide = {};
+    for (int i = 0; i < width; ++i)
+        wide.child[i] = -1;
+    for (int i = 0; i < n; ++i) {
+        const LinearBVHNode& c = nodes[children[i]];
+        wide.setBounds(i, c.bounds());
+        if (c.nPrimitives > 0) {
+            wide.child[i] = c.primitivesOffset;
+            wide.count[i] = c.nPrimitives;
+        }
+        else
+            wide.child[i] = collapse(children[i]);
+    }
+    wideNodes[offset] = wide;
+    return offset;
+}
+
+void BVHAccel::updateStackSize()
+{
+    // children follow their parents, so one pass in order gives the depth of every node
+    int n = int(wideNodes.size()), maxDepth = 0;
+    std::vector<int> depth(n, 1);
+    for (int i = 0; i < n; ++i) {
+        maxDepth = std::max(maxDepth, depth[i]);
+        for (int c = 0; c < WideBVHNode::kWidth; ++c)
+            if (wideNodes[i].child[c] >= 0 && wideNodes[i].count[c] == 0)
+                depth[wideNodes[i].child[c]] = depth[i] + 1;
+    }
+    stackSize = (WideBVHNode::kWidth - 1) * maxDepth + 1;
+}
+
+// [comment]
+// Visits the leaves the ray reaches before tMax, nearest child first, calling
+// leaf(first, count) for each of them. leaf may lower tMax (a closer hit), and returns
+// true to end the traversal. Stack entries keep their entry distance, so the subtrees
+// beyond a hit found in the meantime are dropped when popped. The traversal starts at
+// the interior node root, the root of the tree by default.
+// [/comment]
+template <typename LeafFunction>
+void BVHAccel::traverse(const Ray& ray, float& tMax, LeafFunction&& leaf, int root) const
+{
+    constexpr int width = WideBVHNode::kWidth;
+    struct Entry {
+        int child, count;
+        float tNear;
+    };
+    Entry local[kLocalStackSize];
+    std::vector<Entry> heap;
+    Entry* stack = stackSize > kLocalStackSize ? (heap.resize(stackSize), heap.data()) : local;
+    int size = 0;
+    stack[size++] = {root, 0, 0.f};
+    while (size > 0) {
+        const Entry entry = stack[--size];
+        if (entry.tNear > tMax)
+            continue;
+        if (entry.count > 0) {
+            if (leaf(entry.child, entry.count))
+                return;
+            continue;
+        }
+
+        const WideBVHNode& node = wideNodes[entry.child];
+        float tNear[width];
+        int mask = node.intersect(ray.origin, ray.direction_inv, tMax, tNear);
+        // push the children farthest first, so that the nearest one is popped next
+        int first = size;
+        for (int i = 0; i < width; ++i) {
+            if (!(mask >> i & 1))
+                continue;
+            const Entry child = {node.child[i], node.count[i], tNear[i]};
+            int k = size++;
+            for (; k > first && stack[k - 1].tNear < child.tNear; --k)
+                stack[k] = stack[k - 1];
+            stack[k] = child;
+        }
+    }
+}
+
+// [comment]
+// traverse() for the rays of packet in mask: visits the leaves some of them may reach,
+// calling leaf(first, count, rays) with the mask of those rays; leaf lowers the tMax of
+// the rays it finds hits for. At each node the first ray of the packet is tested against
+// the children, and a child it enters is given all the rays (early accept, as in Wald et
+// al., "Ray Tracing Deformable Scenes Using Dynamic Bounding Volume Hierarchies", 2007):
+// while the packet is coherent, a node costs one ray. The other children are first
+// tested against the bounds on the packet, and only those not rejected are tested ray
+// by ray, keeping the rays that enter them. Entry distances kept on the stack are lower
+// bounds for all the rays of an entry.
+// [/comment]
+template <typename LeafFunction>
+void BVHAccel::traversePacket(RayPacket& packet, uint64_t mask, LeafFunction&& leaf) const
+{
+    constexpr int width = WideBVHNode::kWidth;
+    struct Entry {
+        int child, count;
+        float tNear, order; // lower bound on the entry distances of the rays, sort key
+        uint64_t rays;
+    };
+    // largest tMax of the rays in mask
+    auto maxTMax = [&]() {
+        float t = 0;
+        for (int k = __builtin_ctzll(mask), last = 64 - __builtin_clzll(mask); k < last; ++k)
+            if (mask >> k & 1)
+                t = std::max(t, packet.tMax[k]);
+        return t;
+    };
+    RayInterval bounds = packet.interval(mask);
+    Entry local[kLocalStackSize];
+    std::vector<Entry> heap;
+    Entry* stack = stackSize > kLocalStackSize ? (heap.resize(stackSize), heap.data()) : local;
+    int size = 0;
+    stack[size++] = {0, 0, 0.f, 0.f, mask};
+    while (size > 0) {
+        const Entry entry = stack[--size];
+        if (entry.tNear > bounds.tMax)
+            continue;
+        if (entry.count > 0) {
+            leaf(entry.child, entry.count, entry.rays);
+            bounds.tMax = maxTMax();
+            continue;
+        }
+        if (__builtin_popcountll(entry.rays) < kMinPacketRays) {
+            for (int k = 0; k < packet.size; ++k) {
+                if (!(entry.rays >> k & 1))
+                    continue;
+                const uint64_t ray = uint64_t(1) << k;
+                traverse(packet.ray(k), packet.tMax[k], [&](int first, int count) {
+                    leaf(first, count, ray);
+                    return false;
+                }, entry.child);
+            }
+            bounds.tMax = maxTMax();
+            continue;
+        }
+
+        const WideBVHNode& node = wideNodes[entry.child];
+        const int f = __builtin_ctzll(entry.rays);
+        float tNearFirst[width], tNearBound[width];
+        int firstHits = node.intersect(packet.origin(f), Vector3f(packet.ix[f], packet.iy[f], packet.iz[f]),
+                                       packet.tMax[f], tNearFirst);
+        int candidates = firstHits;
+        for (int i = 0; i < width; ++i)
+            if (node.child[i] >= 0 && !(firstHits >> i & 1)) {
+                candidates |= node.intersect(bounds, tNearBound) & ~firstHits;
+                break;
+            }
+        int first = size;
+        for (int i = 0; i < width; ++i) {
+            if (!(candidates >> i & 1))
+                continue;
+            // a child's box lies within its parent's, so the parent's entry distance bounds its own
+            Entry child = {node.child[i], node.count[i], entry.tNear, tNearFirst[i], entry.rays};
+            if (!(firstHits >> i & 1) || child.count > 0) {
+                child.rays = node.intersect(packet, entry.rays, i, child.tNear);
+                if (!child.rays)
+                    continue;
+                child.order = child.tNear;
+            }
+            int k = size++;
+            for (; k > first && stack[k - 1].order < child.order; --k)
+                stack[k] = stack[k - 1];
+            stack[k] = child;
+        }
+    }
+}
+
 Intersection BVHAccel::Intersect(const Ray& ray) const
 {
     Intersection isect;
-    if (!root)
+    if (wideNodes.empty())
         return isect;
-    isect = BVHAccel::getIntersection(root, ray);
+
+    // The closest hit found so far becomes the t_max of the ray handed to the primitives,
+    // so nested mesh BVHs beyond it are skipped and every hit returned is a closer one.
+    Ray clipped = ray;
+    float tMax = ray.t_max;
+    traverse(ray, tMax, [&](int first, int count) {
+        for (int i = 0; i < count; ++i) {
+            Intersection hit = primitives[first + i]->getIntersection(clipped);
+            if (hit.happened) {
+                isect = hit;
+                clipped.t_max = hit.distance;
+                tMax = hit.distance;
+            }
+        }
+        return false;
+    });
     return isect;
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+void BVHAccel::packTriangles(const std::vector<uint32_t>& faces, const Vector3f* vertices,
+                             const uint32_t* vertexIndex)
 {
-    // TODO Traverse the BVH to find intersection
-    Intersection isect;
-    if (!node->bounds.IntersectP(ray, ray.direction_inv, { int(ray.direction.x < 0), int(ray.direction.y < 0), int(ray.direction.z < 0) }))
-        return isect;
-    if (!node->left && !node->right)
-        return node->object->getIntersection(ray);
-    Intersection left = getIntersection(node->left, ray), right = getIntersection(node->right, ray);
-    return left.distance < right.distance ? left : right;
+    constexpr int width = TrianglePacket::kWidth;
+    packets.clear();
+    for (auto& node : wideNodes) {
+        for (int c = 0; c < WideBVHNode::kWidth; ++c) {
+            if (node.count[c] == 0)
+                continue;
+            int first = int(packets.size());
+            for (int i = 0; i < node.count[c]; ++i) {
+                if (i % width == 0)
+                    packets.emplace_back();
+                uint32_t f = faces[node.child[c] + i];
+                packets.back().set(i % width, vertices[vertexIndex[3 * f]], vertices[vertexIndex[3 * f + 1]],
+                                   vertices[vertexIndex[3 * f + 2]], f);
+            }
+            node.child[c] = first;
+        }
+    }
 }
 
+double BVHAccel::refit(const Vector3f* vertices, const uint32_t* vertexIndex)
+{
+    if (wideNodes.empty())
+        return 1;
 
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
-    if(node->left == nullptr || node->right == nullptr){
-        node->object->Sample(pos, pdf);
-        pdf *= node->area;
-        return;
+    // children follow their parents, so one pass in order gives the depth of every node
+    int n = int(wideNodes.size()), maxDepth = 0;
+    std::vector<int> depth(n, 0);
+    for (int i = 0; i < n; ++i)
+        for (int c = 0; c < WideBVHNode::kWidth; ++c)
+            if (wideNodes[i].child[c] >= 0 && wideNodes[i].count[c] == 0) {
+                depth[wideNodes[i].child[c]] = depth[i] + 1;
+                maxDepth = std::max(maxDepth, depth[i] + 1);
+            }
+    std::vector<std::vector<int>> levels(maxDepth + 1);
+    for (int i = 0; i < n; ++i)
+        levels[depth[i]].push_back(i);
+
+    std::vector<Bounds3> nodeBounds(n);
+    for (int d = maxDepth; d >= 0; --d) {
+        const std::vector<int>& level = levels[d];
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (int k = 0; k < int(level.size()); ++k) {
+            WideBVHNode& node = wideNodes[level[k]];
+            Bounds3 bounds;
+            for (int c = 0; c < WideBVHNode::kWidth; ++c) {
+                if (node.child[c] < 0)
+                    continue;
+                Bounds3 b = node.count[c] > 0 ? refitLeaf(node.child[c], node.count[c], vertices, vertexIndex)
+                                              : nodeBounds[node.child[c]];
+                node.setBounds(c, b);
+                bounds = Union(bounds, b);
+            }
+            nodeBounds[level[k]] = bounds;
+        }
     }
-    if(p < node->left->area) getSample(node->left, p, pos, pdf);
-    else getSample(node->right, p - node->left->area, pos, pdf);
+    return builtSAHCost > 0 ? wideSAHCost() / builtSAHCost : 1;
+}
+
+// Bounds of the leaf with count primitives from first; packed triangles are updated
+// from the vertices on the way.
+Bounds3 BVHAccel::refitLeaf(int first, int count, const Vector3f* vertices, const uint32_t* vertexIndex)
+{
+    Bounds3 bounds;
+    if (packets.empty()) {
+        for (int i = 0; i < count; ++i)
+            bounds = Union(bounds, primitives[first + i]->getBounds());
+        return bounds;
+    }
+
+    assert(vertices && vertexIndex);
+    constexpr int width = TrianglePacket::kWidth;
+    for (int i = 0; i < count; ++i) {
+        TrianglePacket& packet = packets[first + i / width];
+        uint32_t f = packet.id[i % width];
+        const Vector3f& v0 = vertices[vertexIndex[3 * f]];
+        const Vector3f& v1 = vertices[vertexIndex[3 * f + 1]];
+        const Vector3f& v2 = vertices[vertexIndex[3 * f + 2]];
+        packet.set(i % width, v0, v1, v2, f);
+        bounds = Union(Union(Union(bounds, v0), v1), v2);
+    }
+    return bounds;
+}
+
+bool BVHAccel::IntersectTriangles(const Ray& ray, float& t, uint32_t& face) const
+{
+    if (wideNodes.empty())
+        return false;
+
+    constexpr int width = TrianglePacket::kWidth;
+    float tMax = ray.t_max;
+    bool hit = false;
+    traverse(ray, tMax, [&](int first, int count) {
+        for (int i = 0; i < (count + width - 1) / width; ++i) {
+            const TrianglePacket& packet = packets[first + i];
+            int lane = packet.intersect(ray, tMax);
+            if (lane >= 0) {
+                face = packet.id[lane];
+                hit = true;
+            }
+        }
+        return false;
+    });
+    if (hit)
+        t = tMax;
+    return hit;
 }
 
-void BVHAccel::Sample(Intersection &pos, float &pdf){
-    float p = std::sqrt(get_random_float()) * root->area;
-    getSample(root, p, pos, pdf);
-    pdf /= root->area;
-}
\ No newline at end of file
+void BVHAccel::IntersectPacket(RayPacket& packet, Intersection* hits) const
+{
+    if (wideNodes.empty())
+        return;
+    traversePacket(packet, packet.all(), [&](int first, int count, uint64_t rays) {
+        for (int i = 0; i < count; ++i)
+            primitives[first + i]->getIntersections(packet, rays, hits);
+    });
+}
+
+uint64_t BVHAccel::IntersectTrianglesPacket(RayPacket& packet, uint64_t mask, uint32_t* face) const
+{
+    if (wideNodes.empty())
+        return 0;
+
+    constexpr int width = TrianglePacket::kWidth;
+    uint64_t hit = 0;
+    traversePacket(packet, mask, [&](int first, int count, uint64_t rays) {
+        for (int k = 0; k < packet.size; ++k) {
+            if (!(rays >> k & 1))
+                continue;
+            const Vector3f origin = packet.origin(k), direction = packet.direction(k);
+            for (int i = 0; i < (count + width - 1) / width; ++i) {
+                const TrianglePacket& triangles = packets[first + i];
+                int lane = triangles.intersect(origin, direction, packet.tMax[k]);
+                if (lane >= 0) {
+                    face[k] = triangles.id[lane];
+                    hit |= uint64_t(1) << k;
+                }
+            }
+        }
+    });
+    return hit;
+}
+
+// Any-hit query for shadow rays: stops at the first primitive hit within ray.t_max.
+bool BVHAccel::IntersectP(const Ray& ray) const
+{
+    if (wideNodes.empty())
+        return false;
+
+    constexpr int width = TrianglePacket::kWidth;
+    float tMax = ray.t_max;
+    bool occluded = false;
+    traverse(ray, tMax, [&](int first, int count) {
+        if (!packets.empty()) {
+            for (int i = 0; i < (count + width - 1) / width; ++i)
+                if (packets[first + i].occluded(ray, tMax))
+                    return occluded = true;
+        }
+        else {
+            for (int i = 0; i < count; ++i)
+                if (primitives[first + i]->intersect(ray))
+                    return occluded = true;
+        }
+        return false;
+    });
+    return occluded;
+}
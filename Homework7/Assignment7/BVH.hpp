@@ -5,56 +5,189 @@
 #ifndef RAYTRACING_BVH_H
 #define RAYTRACING_BVH_H
 
+#include <algorithm>
 #include <atomic>
 #include <vector>
 #include <memory>
 #include <ctime>
 #include "Object.hpp"
 #include "Ray.hpp"
+#include "RayPacket.hpp"
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
+#include "MemoryArena.hpp"
+#include "TrianglePacket.hpp"
 #include "Vector.hpp"
 
 struct BVHBuildNode;
+
+// Spreads the low 10 bits of v to every third bit
+inline uint32_t leftShift3(uint32_t v)
+{
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// 30-bit Morton code of a point in the unit cube: its coordinates quantized to 10 bits
+// and interleaved, x in the highest bit
+inline uint32_t mortonCode(const Vector3f& p)
+{
+    auto quantize = [](float x) { return uint32_t(std::min(std::max(x * 1024.f, 0.f), 1023.f)); };
+    return (leftShift3(quantize(p.x)) << 2) | (leftShift3(quantize(p.y)) << 1) | leftShift3(quantize(p.z));
+}
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
 
-// BVHAccel Declarations
-inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
-class BVHAccel {
+// Node of the flattened BVH. Nodes are stored depth first, so the first child of an
+// interior node directly follows it and only the second child needs an offset. The bounds
+// are plain floats rather than a Bounds3, whose SSE vectors would make the node 48 bytes;
+// bounds() loads them into one. It is only kept until collapsed into wide nodes.
+struct alignas(32) LinearBVHNode {
+    float pMin[3], pMax[3];
+    union {
+        int primitivesOffset;   // leaf
+        int secondChildOffset;  // interior
+    };
+    uint16_t nPrimitives;  // 0 -> interior node
+    uint8_t axis;          // interior node: xyz
+    uint8_t pad[1];        // ensure 32 byte total size
 
-public:
-    // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    Bounds3 bounds() const
+    {
+        Bounds3 b;
+        b.pMin = Vector3f(pMin[0], pMin[1], pMin[2]);
+        b.pMax = Vector3f(pMax[0], pMax[1], pMax[2]);
+        return b;
+    }
 
-    // BVHAccel Public Methods
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
-    Bounds3 WorldBound() const;
-    ~BVHAccel();
+    void setBounds(const Bounds3& b)
+    {
+        pMin[0] = b.pMin.x, pMin[1] = b.pMin.y, pMin[2] = b.pMin.z;
+        pMax[0] = b.pMax.x, pMax[1] = b.pMax.y, pMax[2] = b.pMax.z;
+    }
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
 
-    Intersection Intersect(const Ray &ray) const;
-    Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
-    bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+// [comment]
+// Node of the 4-wide BVH that is traversed: the binary tree with every other level
+// folded into its parent. The bounds of the children are stored per axis as arrays of
+// kWidth floats, so one loop does the slab test of all of them. A child is an interior
+// node (count 0, child = its index), a leaf (count primitives from child) or empty
+// (child -1).
+// [/comment]
+struct alignas(64) WideBVHNode {
+    static constexpr int kWidth = 4;
+    float lower[3][kWidth], upper[3][kWidth];
+    int child[kWidth];
+    uint16_t count[kWidth];
+    uint8_t pad[8];
 
-    // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    // Children whose box the ray enters before tMax (bit i for child i), with the entry
+    // distances in tNear
+    int intersect(const Vector3f& origin, const Vector3f& invDir, float tMax, float tNear[kWidth]) const
+    {
+        const float o[3] = {origin.x, origin.y, origin.z}, inv[3] = {invDir.x, invDir.y, invDir.z};
+        int hit[kWidth];
+        #pragma omp simd
+        for (int i = 0; i < kWidth; ++i) {
+            float tEnter = 0, tExit = tMax;
+            for (int a = 0; a < 3; ++a) {
+                float t0 = (lower[a][i] - o[a]) * inv[a], t1 = (upper[a][i] - o[a]) * inv[a];
+                tEnter = std::max(tEnter, std::min(t0, t1));
+                tExit = std::min(tExit, std::max(t0, t1));
+            }
+            tNear[i] = tEnter;
+            hit[i] = tEnter <= tExit;
+        }
+        int mask = 0;
+        for (int i = 0; i < kWidth; ++i)
+            mask |= (hit[i] && child[i] >= 0) << i;
+        return mask;
+    }
 
-    // BVHAccel Private Data
-    const int maxPrimsInNode;
-    const SplitMethod splitMethod;
-    std::vector<Object*> primitives;
+    // Children that some ray within the bounds r may enter (bit i for child i), with lower
+    // bounds on their entry distances in tNear: the slab test of intersect() done in
+    // interval arithmetic, leaving out the unbounded axes
+    int intersect(const RayInterval& r, float tNear[kWidth]) const
+    {
+        int hit[kWidth];
+        #pragma omp simd
+        for (int i = 0; i < kWidth; ++i) {
+            float tEnter = 0, tExit = r.tMax;
+            for (int a = 0; a < 3; ++a) {
+                if (!r.bounded[a])
+                    continue;
+                float l0 = lower[a][i] - r.oMax[a], l1 = lower[a][i] - r.oMin[a];
+                float u0 = upper[a][i] - r.oMax[a], u1 = upper[a][i] - r.oMin[a];
+                float t0[4] = {l0 * r.invMin[a], l0 * r.invMax[a], l1 * r.invMin[a], l1 * r.invMax[a]};
+                float t1[4] = {u0 * r.invMin[a], u0 * r.invMax[a], u1 * r.invMin[a], u1 * r.invMax[a]};
+                float lo = std::min(std::min(std::min(t0[0], t0[1]), std::min(t0[2], t0[3])),
+                                    std::min(std::min(t1[0], t1[1]), std::min(t1[2], t1[3])));
+                float hi = std::max(std::max(std::max(t0[0], t0[1]), std::max(t0[2], t0[3])),
+                                    std::max(std::max(t1[0], t1[1]), std::max(t1[2], t1[3])));
+                tEnter = std::max(tEnter, lo);
+                tExit = std::min(tExit, hi);
+            }
+            tNear[i] = tEnter;
+            hit[i] = tEnter <= tExit;
+        }
+        int mask = 0;
+        for (int i = 0; i < kWidth; ++i)
+            mask |= (hit[i] && child[i] >= 0) << i;
+        return mask;
+    }
 
-    void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
-    void Sample(Intersection &pos, float &pdf);
+    // Rays of the packet in mask that enter the box of child i before their tMax, with the
+    // smallest of their entry distances in tNear
+    uint64_t intersect(const RayPacket& packet, uint64_t mask, int i, float& tNear) const
+    {
+        float tEnter[RayPacket::kMaxSize];
+        char hit[RayPacket::kMaxSize];
+        const int first = __builtin_ctzll(mask), last = 64 - __builtin_clzll(mask);
+        #pragma omp simd
+        for (int k = first; k < last; ++k) {
+            const float o[3] = {packet.ox[k], packet.oy[k], packet.oz[k]};
+            const float inv[3] = {packet.ix[k], packet.iy[k], packet.iz[k]};
+            float t0 = 0, t1 = packet.tMax[k];
+            for (int a = 0; a < 3; ++a) {
+                float ta = (lower[a][i] - o[a]) * inv[a], tb = (upper[a][i] - o[a]) * inv[a];
+                t0 = std::max(t0, std::min(ta, tb));
+                t1 = std::min(t1, std::max(ta, tb));
+            }
+            tEnter[k] = t0;
+            hit[k] = t0 <= t1;
+        }
+        uint64_t rays = 0;
+        tNear = std::numeric_limits<float>::infinity();
+        for (int k = first; k < last; ++k)
+            if (hit[k] && (mask >> k & 1)) {
+                rays |= uint64_t(1) << k;
+                tNear = std::min(tNear, tEnter[k]);
+            }
+        return rays;
+    }
+
+    Bounds3 bounds(int i) const
+    {
+        return Bounds3(Vector3f(lower[0][i], lower[1][i], lower[2][i]), Vector3f(upper[0][i], upper[1][i], upper[2][i]));
+    }
+
+    void setBounds(int i, const Bounds3& b)
+    {
+        lower[0][i] = b.pMin.x, lower[1][i] = b.pMin.y, lower[2][i] = b.pMin.z;
+        upper[0][i] = b.pMax.x, upper[1][i] = b.pMax.y, upper[2][i] = b.pMax.z;
+    }
 };
+static_assert(sizeof(WideBVHNode) == 128, "WideBVHNode should fill two cache lines");
 
 struct BVHBuildNode {
     Bounds3 bounds;
     BVHBuildNode *left;
     BVHBuildNode *right;
     Object* object;
-    float area;
 
 public:
     int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
@@ -66,7 +199,100 @@ public:
     }
 };
 
+// BVHAccel Declarations
+inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
+class BVHAccel {
+
+public:
+    // BVHAccel Public Types
+    enum class SplitMethod { NAIVE, SAH, LBVH };
 
+    // BVHAccel Public Methods
+    // leafWidth: number of primitives a leaf intersects at the cost of one (see packTriangles)
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE,
+             int leafWidth = 1);
+    Bounds3 WorldBound() const;
+    ~BVHAccel();
 
+    Intersection Intersect(const Ray &ray) const;
+    bool IntersectP(const Ray &ray) const;
+    BVHBuildNode* root = nullptr;
+
+    // [comment]
+    // Triangle BVHs can store their leaves as TrianglePackets: faces[i] is the index of the
+    // triangle primitives[i], with vertices vertices[vertexIndex[3 * faces[i] + j]].
+    // Afterwards the leaves point into packets, so queries go through IntersectTriangles
+    // (closest hit: distance and face index) and IntersectP instead of Intersect.
+    // [/comment]
+    void packTriangles(const std::vector<uint32_t>& faces, const Vector3f* vertices, const uint32_t* vertexIndex);
+    bool IntersectTriangles(const Ray &ray, float &t, uint32_t &face) const;
+
+    // [comment]
+    // Packet traversal, for coherent rays such as the camera rays of a block of pixels:
+    // the rays of the packet go down the tree together, so each node is fetched once for
+    // all of them, and its children are first tested against bounds on the whole packet
+    // (see RayInterval), which rejects the boxes that none of the rays can enter without
+    // testing them ray by ray. Subtrees entered by fewer than kMinPacketRays rays of the
+    // packet, where it has diverged, are traversed ray by ray.
+    // IntersectPacket is Intersect for every ray of the packet; IntersectTrianglesPacket
+    // is IntersectTriangles for the rays in mask, and returns the mask of those that hit.
+    // Both lower the tMax of the rays that hit to the distance of the hit.
+    // [/comment]
+    static constexpr int kMinPacketRays = 8;
+    void IntersectPacket(RayPacket &packet, Intersection *hits) const;
+    uint64_t IntersectTrianglesPacket(RayPacket &packet, uint64_t mask, uint32_t *face) const;
+
+    // [comment]
+    // Refit for moving geometry: after the primitives moved (for packTriangles BVHs, the
+    // vertices, the faces staying the same) the boxes are recomputed bottom-up over the
+    // same tree, level by level with the nodes of a level in parallel. The tree degrades
+    // as the geometry moves away from the one it was built for; the returned ratio of
+    // its SAH cost to the cost right after the build tells when to build it again
+    // (callers do above kMaxRefitCostGrowth).
+    // [/comment]
+    double refit(const Vector3f* vertices = nullptr, const uint32_t* vertexIndex = nullptr);
+    static constexpr double kMaxRefitCostGrowth = 1.5;
+    // traversal stack entries kept on the call stack; deeper trees use a heap allocated one
+    static constexpr int kLocalStackSize = 128;
+
+    // BVHAccel Private Methods
+    BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& info, int start, int end);
+    int partitionSAH(std::vector<BVHPrimitiveInfo>& info, int start, int end, const Bounds3& bounds,
+                     const Bounds3& centroidBounds, int& splitAxis, double& cost) const;
+    BVHBuildNode* buildLBVH(std::vector<BVHPrimitiveInfo>& info);
+    BVHBuildNode* emitLBVH(const std::vector<BVHPrimitiveInfo>& info, const std::vector<uint32_t>& codes,
+                           int start, int end);
+    void initLeaf(BVHBuildNode* node, const std::vector<BVHPrimitiveInfo>& info, int start, int end,
+                  const Bounds3& bounds) const;
+    double SAHCost() const;
+    double SAHCost(BVHBuildNode* node) const;
+    double wideSAHCost() const;
+    Bounds3 refitLeaf(int first, int count, const Vector3f* vertices, const uint32_t* vertexIndex);
+    int totalNodes(BVHBuildNode* node) const;
+    int flattenBVHTree(BVHBuildNode* node);
+    int collapse(int node);
+    void updateStackSize();
+    template <typename LeafFunction>
+    void traverse(const Ray& ray, float& tMax, LeafFunction&& leaf, int root = 0) const;
+    template <typename LeafFunction>
+    void traversePacket(RayPacket& packet, uint64_t mask, LeafFunction&& leaf) const;
+
+    // BVHAccel Private Data
+    const int maxPrimsInNode;
+    const SplitMethod splitMethod;
+    const int leafWidth;
+    // SAH cost of intersecting n primitives in a leaf
+    double leafCost(int n) const { return (n + leafWidth - 1) / leafWidth; }
+    std::vector<Object*> primitives; // in the order of the leaves after the build
+    std::vector<LinearBVHNode> nodes; // binary tree, only kept until collapsed into wideNodes
+    std::vector<WideBVHNode> wideNodes;
+    // entries the traversal stacks may need: each interior node on a path pops one entry
+    // and pushes up to kWidth
+    int stackSize = 1;
+    std::vector<TrianglePacket> packets;
+    double builtSAHCost = 0; // wideSAHCost() after the build
+    // the build tree (root), freed in one step once it is flattened
+    MemoryArena<BVHBuildNode> buildNodes;
+};
 
 #endif //RAYTRACING_BVH_H
@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <cmath>
+#include "Denoiser.hpp"
+
+static float luminance(const Vector3f& c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
+// albedo channels below this (black materials, nothing hit) are not divided out
+static const float kMinAlbedo = 1e-3f;
+
+std::vector<Vector3f> Denoiser::run(int width, int height, const std::vector<Vector3f>& color,
+                                    const std::vector<float>& variance, const AuxBuffers& aux) const
+{
+    const int n = width * height;
+    std::vector<Vector3f> albedo(n), normal(n), irradiance(n), next(n);
+    std::vector<float> var(n), nextVar(n), gradX(n), gradY(n);
+
+    #pragma omp parallel for
+    for (int k = 0; k < n; ++k) {
+        const Vector3f a = aux.albedo[k];
+        albedo[k] = Vector3f(a.x > kMinAlbedo ? a.x : 1.f, a.y > kMinAlbedo ? a.y : 1.f, a.z > kMinAlbedo ? a.z : 1.f);
+        irradiance[k] = Vector3f(color[k].x / albedo[k].x, color[k].y / albedo[k].y, color[k].z / albedo[k].z);
+        float la = luminance(albedo[k]);
+        var[k] = variance[k] / (la * la);
+        Vector3f N = aux.normal[k];
+        float len = N.norm();
+        normal[k] = len > 0 ? N / len : Vector3f(0.f);
+    }
+
+    // [comment]
+    // Depth gradient per pixel, from the neighbour on the side where depth changes less,
+    // so that it follows the surface the pixel is on rather than a silhouette next to it
+    // [/comment]
+    auto slope = [&](int k, bool hasBefore, int before, bool hasAfter, int after) {
+        float a = hasBefore ? aux.depth[k] - aux.depth[before] : INFINITY;
+        float b = hasAfter ? aux.depth[after] - aux.depth[k] : INFINITY;
+        float s = std::fabs(a) < std::fabs(b) ? a : b;
+        return std::isfinite(s) ? s : 0.f;
+    };
+    #pragma omp parallel for
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x) {
+            int k = y * width + x;
+            gradX[k] = slope(k, x > 0, k - 1, x + 1 < width, k + 1);
+            gradY[k] = slope(k, y > 0, k - width, y + 1 < height, k + width);
+        }
+
+    const float h[3] = {3.f / 8, 1.f / 4, 1.f / 16}; // B3-spline, by distance to the center
+    const int tilesX = (width + tileSize - 1) / tileSize, tilesY = (height + tileSize - 1) / tileSize;
+    for (int it = 0; it < iterations; ++it) {
+        const int step = 1 << it;
+        #pragma omp parallel for schedule(dynamic)
+        for (int t = 0; t < tilesX * tilesY; ++t) {
+            int x0 = t % tilesX * tileSize, y0 = t / tilesX * tileSize;
+            for (int y = y0; y < std::min(height, y0 + tileSize); ++y) {
+                for (int x = x0; x < std::min(width, x0 + tileSize); ++x) {
+                    const int k = y * width + x;
+                    // standard deviation of the luminance, from the variance blurred over 3x3
+                    float blurred = 0, blurredWeight = 0;
+                    for (int dy = -1; dy <= 1; ++dy)
+                        for (int dx = -1; dx <= 1; ++dx) {
+                            int qx = x + dx, qy = y + dy;
+                            if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+                                continue;
+                            float w = (dx ? 0.25f : 0.5f) * (dy ? 0.25f : 0.5f);
+                            blurred += var[qy * width + qx] * w;
+                            blurredWeight += w;
+                        }
+                    const float sigmaL = sigmaLuminance * std::sqrt(std::max(0.f, blurred / blurredWeight)) + 1e-6f;
+                    const float lp = luminance(irradiance[k]), zp = aux.depth[k];
+                    const Vector3f np = normal[k];
+
+                    float w0 = h[0] * h[0];
+                    Vector3f sum = irradiance[k] * w0;
+                    float weight = w0, varSum = var[k] * w0 * w0;
+                    for (int dy = -2; dy <= 2; ++dy) {
+                        int qy = y + dy * step;
+                        if (qy < 0 || qy >= height)
+                            continue;
+                        for (int dx = -2; dx <= 2; ++dx) {
+                            int qx = x + dx * step;
+                            if ((dx == 0 && dy == 0) || qx < 0 || qx >= width)
+                                continue;
+                            const int q = qy * width + qx;
+                            float cosine = dotProduct(np, normal[q]);
+                            if (cosine <= 0)
+                                continue;
+                            float dz = std::fabs(zp - aux.depth[q]) /
+                                       (sigmaDepth * std::fabs(gradX[k] * dx * step + gradY[k] * dy * step) + 1e-3f);
+                            float dl = std::fabs(lp - luminance(irradiance[q])) / sigmaL;
+                            float w = h[std::abs(dx)] * h[std::abs(dy)] * std::pow(cosine, sigmaNormal) * std::exp(-dz - dl);
+                            sum += irradiance[q] * w;
+                            weight += w;
+                            varSum += var[q] * w * w;
+                        }
+                    }
+                    next[k] = sum / weight;
+                    nextVar[k] = varSum / (weight * weight);
+                }
+            }
+        }
+        irradiance.swap(next);
+        var.swap(nextVar);
+    }
+
+    std::vector<Vector3f> out(n);
+    #pragma omp parallel for
+    for (int k = 0; k < n; ++k)
+        out[k] = irradiance[k] * albedo[k];
+    return out;
+}
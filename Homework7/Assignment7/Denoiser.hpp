@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include "Vector.hpp"
+
+// Per-pixel averages of what the camera rays hit first, used to guide the denoiser
+struct AuxBuffers
+{
+    std::vector<Vector3f> albedo; // Material::getAlbedo
+    std::vector<Vector3f> normal; // not normalized (an average over the pixel)
+    std::vector<float> depth;     // distance along the camera ray
+};
+
+// [comment]
+// Edge-avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding A-Trous Wavelet
+// Transform for fast Global Illumination Filtering", HPG 2010), with the edge-stopping
+// functions of SVGF (Schied et al., HPG 2017). Each of the iterations convolves the image
+// with a 5x5 B3-spline kernel whose taps are 2^i pixels apart, so five iterations cover
+// 61x61 pixels at the cost of 25 taps each. The weight of a tap drops with the difference
+// of normals (sigmaNormal is an exponent on their cosine), of depths (relative to the
+// depth gradient over the same distance) and of luminances (relative to the standard
+// deviation of the estimate, which the filter lowers as it goes, so later iterations
+// blur less).
+// The image is filtered divided by the albedo, i.e. as illumination, and multiplied back
+// afterwards, so that texture and material edges stay sharp. Iterations run in parallel
+// over tiles of tileSize x tileSize pixels.
+// [/comment]
+class Denoiser
+{
+public:
+    int iterations = 5;
+    float sigmaLuminance = 4.f;
+    float sigmaNormal = 128.f;
+    float sigmaDepth = 1.f;
+    int tileSize = 16;
+
+    // color: the noisy image; variance: the variance of the luminance estimate per pixel
+    std::vector<Vector3f> run(int width, int height, const std::vector<Vector3f>& color,
+                              const std::vector<float>& variance, const AuxBuffers& aux) const;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include "Vector.hpp"
+
+// [comment]
+// Output formats understood by ImageWriter. The 8-bit formats (PPM, PNG) are gamma
+// corrected and clamped to [0, 1]; PFM (32-bit float) and EXR (16-bit half float)
+// store the linear framebuffer values as they are, so HDR results are kept.
+// [/comment]
+enum class ImageFormat
+{
+    PPM,
+    PNG,
+    PFM,
+    EXR
+};
+
+// Picks the format from the file extension, defaulting to PPM.
+ImageFormat imageFormatFromFilename(const std::string& filename);
+
+// [comment]
+// Streaming image writer. Rows can be handed over as soon as they are rendered and in
+// any order: every call encodes the rows into one buffer and writes it with a single
+// fwrite. PPM, PFM and EXR have fixed-size rows, so each row is written at its final
+// place in the file; PNG is sequential, so rows arriving early are kept (encoded) until
+// the rows before them are done. Rows that were never written are filled with black
+// when the writer is closed.
+// [/comment]
+class ImageWriter
+{
+public:
+    ImageWriter(const std::string& filename, int w, int h, float g = 1.f);
+    ImageWriter(const std::string& filename, ImageFormat fmt, int w, int h, float g = 1.f);
+    ~ImageWriter();
+
+    ImageWriter(const ImageWriter&) = delete;
+    ImageWriter& operator=(const ImageWriter&) = delete;
+
+    bool good() const { return fp != nullptr; }
+    ImageFormat getFormat() const { return format; }
+
+    // Writes rows [y0, y0 + count) of the image; *pixels* points at the first pixel of row y0.
+    void writeRows(int y0, int count, const Vector3f* pixels);
+    void close();
+
+private:
+    void writeHeader();
+    long rowOffset(int y) const;
+    void encodeRow(const Vector3f* pixels, int y, unsigned char* out) const;
+    void writePngData(const std::vector<unsigned char>& data, bool last);
+
+    FILE* fp;
+    ImageFormat format;
+    int width, height;
+    float gamma;
+    long dataOffset = 0;
+    size_t rowBytes;
+    std::vector<bool> rowWritten;
+
+    // PNG only: zlib stream state
+    bool zlibStarted = false;
+    int nextRow = 0;
+    std::map<int, std::vector<unsigned char> > pendingRows;
+    uint32_t adlerA = 1, adlerB = 0;
+};
+
+// Writes a whole framebuffer in one buffered call.
+bool writeImage(const std::string& filename, int width, int height, const std::vector<Vector3f>& framebuffer,
+                float gamma = 1.f);
@@ -0,0 +1,163 @@
+#pragma once
+#include "AliasTable.hpp"
+#include "Object.hpp"
+#include "Transform.hpp"
+#include "Triangle.hpp"
+
+// [comment]
+// A placement of a mesh in the scene: the mesh and its BVH are stored once, in object
+// space, and shared by any number of instances, each of which only adds a transform. Rays
+// are taken into object space to be traced through the mesh BVH, and the hits brought back
+// to world space. The scene's BVH is built over the instances (see Scene::buildBVH), so
+// after moving instances only that top level has to be rebuilt.
+// [/comment]
+class Instance : public Object
+{
+public:
+    Instance(MeshTriangle* mesh, const Transform& objectToWorld) : mesh(mesh) { setTransform(objectToWorld); }
+
+    void setTransform(const Transform& objectToWorld)
+    {
+        this->objectToWorld = objectToWorld;
+        worldToObject = objectToWorld.inverse();
+        rigid = objectToWorld.isRigid();
+        bounds = objectToWorld.bounds(mesh->getBounds());
+
+        // emissive meshes are sampled by the world space area of their faces
+        area = 0;
+        faces = AliasTable();
+        if (!mesh->hasEmit())
+            return;
+        std::vector<float> weights(mesh->numTriangles);
+        for (uint32_t k = 0; k < mesh->numTriangles; ++k) {
+            Vector3f v0 = objectToWorld.point(vertex(k, 0)), v1 = objectToWorld.point(vertex(k, 1)),
+                     v2 = objectToWorld.point(vertex(k, 2));
+            weights[k] = crossProduct(v1 - v0, v2 - v0).norm() * 0.5f;
+            area += weights[k];
+        }
+        faces = AliasTable(weights);
+    }
+
+    bool intersect(const Ray& ray)
+    {
+        float scale;
+        return mesh->intersect(toObject(ray, scale));
+    }
+
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
+    {
+        float scale;
+        Ray local = toObject(ray, scale);
+        float t = tnear * scale;
+        if (!mesh->intersect(local, t, index))
+            return false;
+        tnear = t / scale;
+        return true;
+    }
+
+    Intersection getIntersection(Ray ray)
+    {
+        float scale;
+        Intersection isect = mesh->getIntersection(toObject(ray, scale));
+        if (!isect.happened)
+            return isect;
+        isect.distance /= scale;
+        isect.coords = ray(isect.distance);
+        isect.normal = toWorldNormal(isect.normal);
+        isect.obj = this;
+        return isect;
+    }
+
+    // The rays are taken into object space one by one, and traced through the mesh together
+    void getIntersections(RayPacket& packet, uint64_t mask, Intersection* hits)
+    {
+        RayPacket local;
+        local.size = packet.size;
+        float scale[RayPacket::kMaxSize], tMax[RayPacket::kMaxSize];
+        for (int k = 0; k < packet.size; ++k) {
+            if (!(mask >> k & 1))
+                continue;
+            local.set(k, toObject(packet.ray(k), scale[k]));
+            tMax[k] = local.tMax[k];
+        }
+        mesh->getIntersections(local, mask, hits);
+        // the mesh lowered the tMax of the rays it hit
+        for (int k = 0; k < packet.size; ++k) {
+            if (!(mask >> k & 1) || local.tMax[k] >= tMax[k])
+                continue;
+            Intersection& isect = hits[k];
+            isect.distance /= scale[k];
+            isect.coords = packet.origin(k) + packet.direction(k) * isect.distance;
+            isect.normal = toWorldNormal(isect.normal);
+            isect.obj = this;
+            packet.tMax[k] = isect.distance;
+        }
+    }
+
+    void getSurfaceProperties(const Vector3f& P, const Vector3f& I, const uint32_t& index,
+                              const Vector2f& uv, Vector3f& N, Vector2f& st) const
+    {
+        mesh->getSurfaceProperties(worldToObject.point(P), worldToObject.vector(I), index, uv, N, st);
+        N = toWorldNormal(N);
+    }
+
+    Vector3f evalDiffuseColor(const Vector2f& st) const { return mesh->evalDiffuseColor(st); }
+
+    Bounds3 getBounds() { return bounds; }
+
+    // [comment]
+    // Emissive meshes are light sampled as a whole through their instances: a face is
+    // picked by its world space area, then a point uniformly on it. The area is that of
+    // the instance in world space, and is only computed for emissive meshes.
+    // [/comment]
+    float getArea() { return area; }
+    void Sample(Intersection& pos, float& pdf)
+    {
+        pdf = 0;
+        if (faces.empty())
+            return;
+        uint32_t k = uint32_t(faces.sample(get_random_float()));
+        const Vector3f o0 = vertex(k, 0), o1 = vertex(k, 1), o2 = vertex(k, 2);
+        float x = std::sqrt(get_random_float()), y = get_random_float();
+        pos.coords = objectToWorld.point(o0 * (1.0f - x) + o1 * (x * (1.0f - y)) + o2 * (x * y));
+        pos.normal = toWorldNormal(normalize(crossProduct(o1 - o0, o2 - o0)));
+        pos.emit = mesh->m->getEmission();
+        pdf = 1.0f / area;
+    }
+    bool hasEmit() { return mesh->hasEmit(); }
+
+    MeshTriangle* mesh;
+
+private:
+    // [comment]
+    // The ray in object space, with its direction normalized again, so the mesh is hit the
+    // same way at any scale of the instance. One unit along the world ray is scale units
+    // along the object ray, which is how t and t_max are converted. Rigid transforms keep
+    // the direction as it is (scale 1), so that the identity traces exactly like the mesh.
+    // [/comment]
+    Ray toObject(const Ray& ray, float& scale) const
+    {
+        Vector3f dir = worldToObject.vector(ray.direction);
+        scale = rigid ? 1.0f : dir.norm();
+        Ray local(worldToObject.point(ray.origin), dir / scale, ray.t);
+        local.t_min = ray.t_min * scale;
+        local.t_max = ray.t_max * scale;
+        return local;
+    }
+
+    Vector3f toWorldNormal(const Vector3f& n) const
+    {
+        return rigid ? objectToWorld.normal(n) : normalize(objectToWorld.normal(n));
+    }
+
+    const Vector3f& vertex(uint32_t face, int corner) const
+    {
+        return mesh->vertices[mesh->vertexIndex[3 * face + corner]];
+    }
+
+    Transform objectToWorld, worldToObject;
+    bool rigid = true;
+    Bounds3 bounds;
+    float area = 0;
+    AliasTable faces; // emissive meshes only
+};
@@ -7,7 +7,19 @@
 
 #include "Vector.hpp"
 
-enum MaterialType { DIFFUSE};
+enum MaterialType { DIFFUSE, MICROFACET };
+
+// [comment]
+// Result of importance sampling a material: the outgoing direction, its pdf (solid
+// angle) and the weight eval * cos / pdf the path throughput is multiplied by. pdf == 0
+// means no direction was produced.
+// [/comment]
+struct BSDFSample
+{
+    Vector3f wo;
+    float pdf = 0;
+    Vector3f weight;
+};
 
 class Material{
 private:
@@ -71,7 +83,38 @@ private:
         // kt = 1 - kr;
     }
 
-    Vector3f toWorld(const Vector3f &a, const Vector3f &N){
+    // Uniform in [0,1)^2 -> direction around +z with pdf cos / pi
+    static Vector3f cosineSampleHemisphere(float x_1, float x_2)
+    {
+        float r = std::sqrt(x_1), phi = 2 * M_PI * x_2;
+        return Vector3f(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::max(0.f, 1.0f - x_1)));
+    }
+
+    // GGX normal distribution, alpha = roughness^2
+    float ggxD(float cosThetaH) const
+    {
+        float a2 = alpha() * alpha();
+        float d = cosThetaH * cosThetaH * (a2 - 1) + 1;
+        return a2 / (M_PI * d * d);
+    }
+
+    // Smith masking term for GGX
+    float ggxG1(float cosTheta) const
+    {
+        float a2 = alpha() * alpha();
+        return 2 * cosTheta / (cosTheta + std::sqrt(a2 + (1 - a2) * cosTheta * cosTheta));
+    }
+
+    float alpha() const { return std::max(roughness * roughness, 1e-3f); }
+
+    // Probability of picking the glossy lobe when sampling a MICROFACET material
+    float specularProbability() const
+    {
+        float s = Ks.x + Ks.y + Ks.z, d = Kd.x + Kd.y + Kd.z;
+        return s + d > 0 ? s / (s + d) : 0.5f;
+    }
+
+    Vector3f toWorld(const Vector3f &a, const Vector3f &N) const {
         Vector3f B, C;
         if (std::fabs(N.x) > std::fabs(N.y)){
             float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
@@ -92,6 +135,7 @@ public:
     float ior;
     Vector3f Kd, Ks;
     float specularExponent;
+    float roughness = 0.3f; // MICROFACET: GGX roughness, Ks is the reflectance at normal incidence
     //Texture tex;
 
     inline Material(MaterialType t=DIFFUSE, Vector3f e=Vector3f(0,0,0));
@@ -100,7 +144,11 @@ public:
     inline Vector3f getColorAt(double u, double v);
     inline Vector3f getEmission();
     inline bool hasEmission();
+    // Reflectance guiding the denoiser: Kd, plus Ks for MICROFACET
+    inline Vector3f getAlbedo();
 
+    // sample a direction, its pdf and weight in one go (wi points towards the surface)
+    inline BSDFSample sampleBSDF(const Vector3f &wi, const Vector3f &N);
     // sample a ray by Material properties
     inline Vector3f sample(const Vector3f &wi, const Vector3f &N);
     // given a ray, calculate the PdF of this ray
@@ -124,56 +172,105 @@ bool Material::hasEmission() {
     else return false;
 }
 
+Vector3f Material::getAlbedo() {
+    return m_type == MICROFACET ? Kd + Ks : Kd;
+}
+
 Vector3f Material::getColorAt(double u, double v) {
     return Vector3f();
 }
 
 
-Vector3f Material::sample(const Vector3f &wi, const Vector3f &N){
+BSDFSample Material::sampleBSDF(const Vector3f &wi, const Vector3f &N){
+    BSDFSample bs;
     switch(m_type){
         case DIFFUSE:
         {
-            // uniform sample on the hemisphere
+            // cosine-weighted: eval * cos / pdf reduces to Kd
             float x_1 = get_random_float(), x_2 = get_random_float();
-            float z = std::fabs(1.0f - 2.0f * x_1);
-            float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
-            Vector3f localRay(r*std::cos(phi), r*std::sin(phi), z);
-            return toWorld(localRay, N);
-            
-            break;
+            Vector3f local = cosineSampleHemisphere(x_1, x_2);
+            if (local.z <= 0.0f)
+                return bs;
+            bs.wo = toWorld(local, N);
+            bs.pdf = local.z / M_PI;
+            bs.weight = Kd;
+            return bs;
+        }
+        case MICROFACET:
+        {
+            // pick the diffuse or the GGX lobe, then weight by the pdf of the mixture
+            float x_0 = get_random_float(), x_1 = get_random_float(), x_2 = get_random_float();
+            if (x_0 < specularProbability()) {
+                float a2 = alpha() * alpha();
+                float cosThetaH = std::sqrt((1 - x_1) / (1 + (a2 - 1) * x_1));
+                float sinThetaH = std::sqrt(std::max(0.f, 1 - cosThetaH * cosThetaH)), phi = 2 * M_PI * x_2;
+                Vector3f h = toWorld(Vector3f(sinThetaH * std::cos(phi), sinThetaH * std::sin(phi), cosThetaH), N);
+                bs.wo = 2 * dotProduct(-wi, h) * h + wi;
+            }
+            else
+                bs.wo = toWorld(cosineSampleHemisphere(x_1, x_2), N);
+            float cosTheta = dotProduct(bs.wo, N);
+            bs.pdf = cosTheta > 0 ? pdf(wi, bs.wo, N) : 0;
+            if (bs.pdf > 0)
+                bs.weight = eval(wi, bs.wo, N) * (cosTheta / bs.pdf);
+            return bs;
         }
     }
+    return bs;
+}
+
+Vector3f Material::sample(const Vector3f &wi, const Vector3f &N){
+    return sampleBSDF(wi, N).wo;
 }
 
 float Material::pdf(const Vector3f &wi, const Vector3f &wo, const Vector3f &N){
+    float cosTheta = dotProduct(wo, N);
+    if (cosTheta <= 0.0f)
+        return 0.0f;
     switch(m_type){
         case DIFFUSE:
         {
-            // uniform sample probability 1 / (2 * PI)
-            if (dotProduct(wo, N) > 0.0f)
-                return 0.5f / M_PI;
-            else
-                return 0.0f;
-            break;
+            // cosine-weighted sample probability cos / PI
+            return cosTheta / M_PI;
+        }
+        case MICROFACET:
+        {
+            Vector3f h = normalize(wo - wi);
+            float cosThetaH = dotProduct(h, N), woDotH = dotProduct(wo, h);
+            float pdfSpec = woDotH > 0 ? ggxD(cosThetaH) * cosThetaH / (4 * woDotH) : 0;
+            float pSpec = specularProbability();
+            return pSpec * pdfSpec + (1 - pSpec) * cosTheta / M_PI;
         }
     }
+    return 0.0f;
 }
 
 Vector3f Material::eval(const Vector3f &wi, const Vector3f &wo, const Vector3f &N){
+    // calculate the contribution of diffuse   model
+    float cosalpha = dotProduct(N, wo);
+    if (cosalpha <= 0.0f)
+        return Vector3f(0.0f);
     switch(m_type){
         case DIFFUSE:
         {
-            // calculate the contribution of diffuse   model
-            float cosalpha = dotProduct(N, wo);
-            if (cosalpha > 0.0f) {
-                Vector3f diffuse = Kd / M_PI;
-                return diffuse;
-            }
-            else
-                return Vector3f(0.0f);
-            break;
+            Vector3f diffuse = Kd / M_PI;
+            return diffuse;
+        }
+        case MICROFACET:
+        {
+            // Kd / PI plus Cook-Torrance GGX with Schlick's Fresnel (F0 = Ks)
+            float cosThetaI = dotProduct(-wi, N);
+            if (cosThetaI <= 0.0f)
+                return Kd / M_PI;
+            Vector3f h = normalize(wo - wi);
+            float cosThetaH = std::max(0.f, dotProduct(h, N));
+            float c = 1 - std::max(0.f, dotProduct(wo, h));
+            Vector3f F = Ks + (Vector3f(1.f) - Ks) * (c * c * c * c * c);
+            float DG = ggxD(cosThetaH) * ggxG1(cosThetaI) * ggxG1(cosalpha);
+            return Kd / M_PI + F * (DG / (4 * cosThetaI * cosalpha));
         }
     }
+    return Vector3f(0.0f);
 }
 
 #endif //RAYTRACING_MATERIAL_H
@@ -0,0 +1,183 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// [comment]
+// Binary cache of a mesh and its BVH, written next to the OBJ file the first time it is
+// loaded, so that later runs skip both the parsing and the build. After a header (the
+// layout version of the caller and the key: hash and size of the source file and the
+// build parameters) come arrays, each with its element count and size and aligned to 64
+// bytes. The reader maps the file and hands out pointers into the mapping. A cache whose
+// header or array types do not match is ignored, and replaced once the mesh is built.
+// [/comment]
+class MeshCache
+{
+public:
+    struct Key
+    {
+        uint64_t sourceHash = 0, sourceSize = 0;
+        int32_t params[4] = {};
+    };
+
+    static std::string path(const std::string& filename) { return filename + ".meshcache"; }
+
+    // FNV-1a over the 8-byte words of the file (and its last bytes)
+    static bool hashFile(const std::string& filename, Key& key)
+    {
+        MeshCache file;
+        if (!file.map(filename))
+            return false;
+        uint64_t h = 14695981039346656037ull;
+        size_t n = file.size / 8;
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t w;
+            std::memcpy(&w, file.data + 8 * i, 8);
+            h = (h ^ w) * 1099511628211ull;
+        }
+        for (size_t i = 8 * n; i < file.size; ++i)
+            h = (h ^ uint8_t(file.data[i])) * 1099511628211ull;
+        key.sourceHash = h;
+        key.sourceSize = file.size;
+        return true;
+    }
+
+    MeshCache() = default;
+    MeshCache(const MeshCache&) = delete;
+    MeshCache& operator=(const MeshCache&) = delete;
+    ~MeshCache()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        if (mapped)
+            munmap(mapped, size);
+#endif
+    }
+
+    // Maps the cache at path if it was written with this version and key
+    bool open(const std::string& path, uint32_t version, const Key& key)
+    {
+        if (!map(path) || size < sizeof(Header))
+            return false;
+        Header header;
+        std::memcpy(&header, data, sizeof(Header));
+        offset = align(sizeof(Header));
+        return std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 && header.version == version &&
+               std::memcmp(&header.key, &key, sizeof(Key)) == 0;
+    }
+
+    // The next array of the cache and its count, or nullptr and 0 if it is not one of T
+    template <typename T>
+    const T* array(size_t& count)
+    {
+        count = 0;
+        ArrayHeader a;
+        if (offset + sizeof(a) > size)
+            return nullptr;
+        std::memcpy(&a, data + offset, sizeof(a));
+        size_t begin = align(offset + sizeof(a));
+        if (a.elementSize != sizeof(T) || begin + a.count * sizeof(T) > size)
+            return nullptr;
+        offset = align(begin + a.count * sizeof(T));
+        count = size_t(a.count);
+        return reinterpret_cast<const T*>(data + begin);
+    }
+
+    // Appends an array to be written by save()
+    template <typename T>
+    void add(const T* array, size_t count)
+    {
+        if (buffer.empty())
+            buffer.resize(align(sizeof(Header)));
+        ArrayHeader a = {uint64_t(count), uint32_t(sizeof(T)), 0};
+        size_t at = buffer.size();
+        buffer.resize(align(at + sizeof(a)));
+        std::memcpy(&buffer[at], &a, sizeof(a));
+        at = buffer.size();
+        buffer.resize(align(at + count * sizeof(T)));
+        if (count > 0)
+            std::memcpy(&buffer[at], array, count * sizeof(T));
+    }
+
+    // Writes the arrays added to path, through a temporary file so that readers never see
+    // a partial cache; failing to write (e.g. a read-only directory) is not an error.
+    bool save(const std::string& path, uint32_t version, const Key& key)
+    {
+        if (buffer.empty())
+            buffer.resize(align(sizeof(Header)));
+        Header header;
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = version;
+        header.key = key;
+        std::memcpy(buffer.data(), &header, sizeof(header));
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            if (!out.write(buffer.data(), std::streamsize(buffer.size())))
+                return false;
+        }
+        return std::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    static constexpr char kMagic[8] = {'M', 'E', 'S', 'H', 'B', 'V', 'H', '\0'};
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t pad = 0;
+        Key key;
+    };
+
+    struct ArrayHeader
+    {
+        uint64_t count;
+        uint32_t elementSize;
+        uint32_t pad;
+    };
+
+    static size_t align(size_t n) { return (n + 63) & ~size_t(63); }
+
+    bool map(const std::string& filename)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                mapped = p;
+                size = size_t(st.st_size);
+                data = static_cast<const char*>(p);
+            }
+        }
+        ::close(fd);
+        return mapped != nullptr;
+#else
+        std::ifstream in(filename, std::ios::binary);
+        if (!in)
+            return false;
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data = contents.data();
+        size = contents.size();
+        return size > 0;
+#endif
+    }
+
+    const char* data = nullptr;
+    size_t size = 0, offset = 0;
+    void* mapped = nullptr;
+    std::string contents; // the file, where it cannot be mapped
+    std::vector<char> buffer;
+};
@@ -5,10 +5,12 @@
 #ifndef RAYTRACING_OBJECT_H
 #define RAYTRACING_OBJECT_H
 
+#include <vector>
 #include "Vector.hpp"
 #include "global.hpp"
 #include "Bounds3.hpp"
 #include "Ray.hpp"
+#include "RayPacket.hpp"
 #include "Intersection.hpp"
 
 class Object
@@ -19,12 +21,29 @@ public:
     virtual bool intersect(const Ray& ray) = 0;
     virtual bool intersect(const Ray& ray, float &, uint32_t &) const = 0;
     virtual Intersection getIntersection(Ray _ray) = 0;
+    // Packet form of getIntersection (see BVHAccel::IntersectPacket): the hits of the rays in
+    // mask closer than their tMax go to hits, and their tMax is lowered to the hit distance.
+    // Meshes trace the packet through their BVH; other objects take the rays one by one.
+    virtual void getIntersections(RayPacket &packet, uint64_t mask, Intersection *hits)
+    {
+        for (int k = 0; k < packet.size; ++k) {
+            if (!(mask >> k & 1))
+                continue;
+            Intersection hit = getIntersection(packet.ray(k));
+            if (hit.happened) {
+                hits[k] = hit;
+                packet.tMax[k] = hit.distance;
+            }
+        }
+    }
     virtual void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &, const Vector2f &, Vector3f &, Vector2f &) const = 0;
     virtual Vector3f evalDiffuseColor(const Vector2f &) const =0;
     virtual Bounds3 getBounds()=0;
     virtual float getArea()=0;
     virtual void Sample(Intersection &pos, float &pdf)=0;
     virtual bool hasEmit()=0;
+    // Appends the emissive primitives that can be sampled on their own (see Scene::sampleLight)
+    virtual void collectEmitters(std::vector<Object*> &emitters) { if (hasEmit()) emitters.push_back(this); }
 };
 
 
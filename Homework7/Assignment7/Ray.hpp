@@ -15,7 +15,7 @@ struct Ray{
     Ray(const Vector3f& ori, const Vector3f& dir, const double _t = 0.0): origin(ori), direction(dir),t(_t) {
         direction_inv = Vector3f(1./direction.x, 1./direction.y, 1./direction.z);
         t_min = 0.0;
-        t_max = std::numeric_limits<double>::max();
+        t_max = std::numeric_limits<double>::infinity();
 
     }
 
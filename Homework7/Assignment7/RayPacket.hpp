@@ -0,0 +1,80 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include "Ray.hpp"
+#include "Vector.hpp"
+
+// [comment]
+// Bounds on a set of rays, per axis: their origins lie in [oMin, oMax], the inverses of
+// their directions in [invMin, invMax] and their t_max are at most tMax. Where the
+// directions differ in sign, or one is parallel to the axis, the inverses are unbounded
+// and the axis says nothing (bounded false).
+// [/comment]
+struct RayInterval
+{
+    float oMin[3], oMax[3], invMin[3], invMax[3], tMax;
+    bool bounded[3];
+};
+
+// [comment]
+// Up to kMaxSize rays traced together (see BVHAccel::IntersectPacket), such as the camera
+// rays of a block of pixels, stored as structure of arrays so that one loop tests a box
+// against all of them. Sets of rays of a packet are bit masks, bit k for ray k. tMax[k] is
+// the t_max of ray k, which the queries lower to the closest hit found.
+// [/comment]
+struct RayPacket
+{
+    static constexpr int kMaxSize = 64;
+
+    int size = 0;
+    // rays left unset are zero, and hit nothing
+    float ox[kMaxSize] = {}, oy[kMaxSize] = {}, oz[kMaxSize] = {};
+    float dx[kMaxSize] = {}, dy[kMaxSize] = {}, dz[kMaxSize] = {};
+    float ix[kMaxSize] = {}, iy[kMaxSize] = {}, iz[kMaxSize] = {};
+    float tMax[kMaxSize] = {};
+
+    void set(int k, const Ray& ray)
+    {
+        ox[k] = ray.origin.x, oy[k] = ray.origin.y, oz[k] = ray.origin.z;
+        dx[k] = ray.direction.x, dy[k] = ray.direction.y, dz[k] = ray.direction.z;
+        ix[k] = ray.direction_inv.x, iy[k] = ray.direction_inv.y, iz[k] = ray.direction_inv.z;
+        tMax[k] = float(ray.t_max);
+    }
+
+    Vector3f origin(int k) const { return Vector3f(ox[k], oy[k], oz[k]); }
+    Vector3f direction(int k) const { return Vector3f(dx[k], dy[k], dz[k]); }
+    Ray ray(int k) const
+    {
+        Ray r(origin(k), direction(k));
+        r.t_max = tMax[k];
+        return r;
+    }
+
+    uint64_t all() const { return size >= kMaxSize ? ~uint64_t(0) : (uint64_t(1) << size) - 1; }
+
+    RayInterval interval(uint64_t mask) const
+    {
+        RayInterval r;
+        const float* o[3] = {ox, oy, oz};
+        const float* inv[3] = {ix, iy, iz};
+        r.tMax = 0;
+        for (int k = 0; k < size; ++k)
+            if (mask >> k & 1)
+                r.tMax = std::max(r.tMax, tMax[k]);
+        for (int a = 0; a < 3; ++a) {
+            r.oMin[a] = r.invMin[a] = std::numeric_limits<float>::infinity();
+            r.oMax[a] = r.invMax[a] = -std::numeric_limits<float>::infinity();
+            for (int k = 0; k < size; ++k) {
+                if (!(mask >> k & 1))
+                    continue;
+                r.oMin[a] = std::min(r.oMin[a], o[a][k]), r.oMax[a] = std::max(r.oMax[a], o[a][k]);
+                r.invMin[a] = std::min(r.invMin[a], inv[a][k]), r.invMax[a] = std::max(r.invMax[a], inv[a][k]);
+            }
+            r.bounded[a] = std::isfinite(r.invMin[a]) && std::isfinite(r.invMax[a]) &&
+                           (r.invMin[a] > 0 || r.invMax[a] < 0);
+        }
+        return r;
+    }
+};
@@ -0,0 +1,144 @@
+// [comment]
+// Check of BVH refitting (MeshTriangle::refit, Scene::refitBVH) against fresh builds:
+// the bunny, the tall box and the Cornell light are deformed a little more every frame
+// (twisted, moved and, for the light, scaled), which takes the refit trees through
+// both the refit and the rebuild path. Every frame the refit scene and a scene built
+// from scratch over copies of the same vertices must report the same closest hits
+// (single rays and packets), occlusion and light pdfs for a fixed set of rays.
+//
+//     cmake --build build --target RefitTest && ctest --test-dir build
+// [/comment]
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+#include "Scene.hpp"
+#include "Triangle.hpp"
+
+// A mesh loaded twice: one copy is refit as it moves, the other built again every frame
+struct MovingMesh
+{
+    MovingMesh(const std::string& filename, Material* m)
+        : refit(new MeshTriangle(filename, m)), fresh(new MeshTriangle(filename, m)),
+          rest(refit->vertices.get(), refit->vertices.get() + refit->numVertices)
+    {
+        for (const Vector3f& v : rest)
+            bounds = Union(bounds, v);
+    }
+
+    // Twists the rest shape around the vertical axis through its center, by an angle
+    // growing with the height (flat shapes are left as they are), then scales and moves it
+    void pose(float twist, float scale, const Vector3f& offset)
+    {
+        Vector3f center = bounds.Centroid(), extent = bounds.Diagonal();
+        for (size_t i = 0; i < rest.size(); ++i) {
+            Vector3f p = rest[i] - center;
+            float angle = extent.y > 0 ? twist * p.y / extent.y : 0;
+            float c = std::cos(angle), s = std::sin(angle);
+            p = Vector3f(c * p.x + s * p.z, p.y, -s * p.x + c * p.z) * scale;
+            refit->vertices[i] = fresh->vertices[i] = center + p + offset;
+        }
+        refit->refit();
+        fresh->buildBVH();
+    }
+
+    std::unique_ptr<MeshTriangle> refit, fresh;
+    std::vector<Vector3f> rest;
+    Bounds3 bounds;
+};
+
+int main()
+{
+    Material* white = new Material(DIFFUSE, Vector3f(0.0f));
+    white->Kd = Vector3f(0.725f, 0.71f, 0.68f);
+    Material* light = new Material(DIFFUSE, Vector3f(8.0f));
+    light->Kd = Vector3f(0.65f);
+
+    const std::string dir = RAYTRACING_MODEL_DIR;
+    MovingMesh bunny(dir + "/bunny/bunny.obj", white);
+    MovingMesh tallbox(dir + "/cornellbox/tallbox.obj", white);
+    MovingMesh lamp(dir + "/cornellbox/light.obj", light);
+    MeshTriangle floor(dir + "/cornellbox/floor.obj", white);
+
+    // frame t of frames: the bunny, scaled from its model size (about 0.15) to stand on
+    // the floor, twists up to 6 radians around its axis; the box turns and slides, and the
+    // light comes down and grows to twice its size
+    const int frames = 12;
+    auto pose = [&](int frame) {
+        float t = float(frame) / frames;
+        bunny.pose(6.f * t, 1000.f, Vector3f(150 + 200 * t, 100, 150 + 100 * t) - bunny.bounds.Centroid());
+        tallbox.pose(2.f * t, 1.f, Vector3f(-150 * t, 0, 50 * t));
+        lamp.pose(0.f, 1.f + t, Vector3f(0, -100 * t, 0));
+    };
+    pose(0);
+
+    Scene refitScene(64, 64), freshScene(64, 64);
+    for (MovingMesh* mesh : {&bunny, &tallbox, &lamp}) {
+        refitScene.Add(mesh->refit.get());
+        freshScene.Add(mesh->fresh.get());
+    }
+    refitScene.Add(&floor);
+    freshScene.Add(&floor);
+    refitScene.buildBVH();
+
+    // rays from all around the box towards random points in it
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> u(0.f, 1.f);
+    std::vector<Ray> rays;
+    for (int i = 0; i < 20000; ++i) {
+        Vector3f from(u(rng) * 1200 - 300, u(rng) * 1200 - 300, u(rng) * 1200 - 300);
+        Vector3f to(u(rng) * 556, u(rng) * 556, u(rng) * 556);
+        rays.emplace_back(from, normalize(to - from));
+    }
+
+    int failures = 0, refits = 0, rebuilds = 0;
+    for (int frame = 1; frame <= frames; ++frame) {
+        const BVHAccel* bunnyTree = bunny.refit->bvh.get();
+        pose(frame);
+        refitScene.refitBVH();
+        freshScene.buildBVH();
+        bool rebuilt = bunny.refit->bvh.get() != bunnyTree;
+        refits += !rebuilt;
+        rebuilds += rebuilt;
+
+        int mismatches = 0, hits = 0;
+        for (size_t i = 0; i < rays.size(); ++i) {
+            Intersection a = refitScene.intersect(rays[i]), b = freshScene.intersect(rays[i]);
+            hits += b.happened;
+            bool same = a.happened == b.happened;
+            if (same && b.happened) {
+                same = a.distance == b.distance && a.obj->hasEmit() == b.obj->hasEmit() &&
+                       refitScene.emitterPdf(a.obj) == freshScene.emitterPdf(b.obj);
+                // occlusion up to just before the hit
+                Ray segment = rays[i];
+                segment.t_max = b.distance * 0.999;
+                same = same && refitScene.intersectP(segment) == freshScene.intersectP(segment);
+            }
+            mismatches += !same;
+        }
+
+        // camera-like packets from a common origin, against the refit scene's single rays
+        for (size_t i = 0; i + RayPacket::kMaxSize <= rays.size(); i += RayPacket::kMaxSize) {
+            RayPacket packet;
+            Intersection packetHits[RayPacket::kMaxSize];
+            packet.size = RayPacket::kMaxSize;
+            Vector3f origin = rays[i].origin;
+            for (int k = 0; k < packet.size; ++k)
+                packet.set(k, Ray(origin, rays[i + k].direction));
+            refitScene.intersect(packet, packetHits);
+            for (int k = 0; k < packet.size; ++k) {
+                Intersection b = freshScene.intersect(Ray(origin, rays[i + k].direction));
+                const Intersection& a = packetHits[k];
+                mismatches += a.happened != b.happened || (b.happened && a.distance != b.distance);
+            }
+        }
+
+        printf("frame %2d: bunny %s, %d of %zu rays hit, light area %.0f, %d mismatches\n", frame,
+               rebuilt ? "rebuilt" : "refit", hits, rays.size(), lamp.refit->getArea(), mismatches);
+        failures += mismatches;
+    }
+    printf("%d frames, bunny refit %d and rebuilt %d times, %d mismatches\n", frames, refits, rebuilds, failures);
+    // both paths of MeshTriangle::refit have to be taken for the check to mean anything
+    return failures == 0 && refits > 0 && rebuilds > 0 ? 0 : 1;
+}
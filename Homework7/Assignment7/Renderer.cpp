@@ -2,57 +2,640 @@
 // Created by goksu on 2/25/20.
 //
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include "Scene.hpp"
 #include "Renderer.hpp"
+#include "ImageWriter.hpp"
+#include "Denoiser.hpp"
 
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
 const float EPSILON = 0.00001;
 
+// Primary ray through the point offset (in [0, 1)^2) of pixel (i, j)
+static Ray cameraRay(const Scene& scene, int i, int j, const Vector2f& offset)
+{
+    float scale = tan(deg2rad(scene.fov * 0.5));
+    float imageAspectRatio = scene.width / (float)scene.height;
+    Vector3f eye_pos(278, 273, -800);
+
+    // generate primary ray direction
+    float x = (2 * (i + offset.x) / (float)scene.width - 1) *
+              imageAspectRatio * scale;
+    float y = (1 - 2 * (j + offset.y) / (float)scene.height) * scale;
+
+    Vector3f dir = normalize(Vector3f(-x, y, 1));
+    return Ray(eye_pos, dir);
+}
+
+// Camera ray of the sample the sampler of the calling thread is at, jittered over the
+// pixel with the first two dimensions of the sample
+static Ray cameraRay(const Scene& scene, int i, int j)
+{
+    float u = get_random_float();
+    float v = get_random_float();
+    return cameraRay(scene, i, j, Vector2f(u, v));
+}
+
+// Checkpoint layout: magic, version, the settings the sums depend on (see
+// checkpointSettings), passes, then for the width * height pixels the RGB float sums of
+// their samples, the float sums of the squared luminances, the uint32 sample counts, and
+// the float sums of the albedos (RGB), normals (XYZ) and depths.
+static const char kCheckpointMagic[4] = {'P', 'T', 'C', 'K'};
+static const uint32_t kCheckpointVersion = 4;
+static const int kCheckpointSettings = 9;
+
+// width, height, spp, sample mode, seed (low and high half), and the adaptive threshold
+// (its bits), minimum spp and tile size; a checkpoint only resumes a render where they all
+// match, since they decide which samples the sums hold
+static void checkpointSettings(const Renderer& r, int width, int height, uint32_t settings[kCheckpointSettings])
+{
+    uint32_t threshold;
+    memcpy(&threshold, &r.adaptiveThreshold, sizeof(threshold));
+    const uint32_t values[kCheckpointSettings] = {
+        uint32_t(width), uint32_t(height), uint32_t(r.spp), uint32_t(r.sampleMode), uint32_t(r.seed),
+        uint32_t(r.seed >> 32), threshold, uint32_t(r.adaptiveMinSpp), uint32_t(r.tileSize)};
+    memcpy(settings, values, sizeof(values));
+}
+
+// The components of vectors, one after the other
+static std::vector<float> flatten(const std::vector<Vector3f>& v)
+{
+    std::vector<float> data(v.size() * 3);
+    for (size_t i = 0; i < v.size(); ++i) {
+        data[i * 3] = v[i].x;
+        data[i * 3 + 1] = v[i].y;
+        data[i * 3 + 2] = v[i].z;
+    }
+    return data;
+}
+
+static std::vector<Vector3f> unflatten(const std::vector<float>& data)
+{
+    std::vector<Vector3f> v(data.size() / 3);
+    for (size_t i = 0; i < v.size(); ++i)
+        v[i] = Vector3f(data[i * 3], data[i * 3 + 1], data[i * 3 + 2]);
+    return v;
+}
+
+static float luminance(const Vector3f& c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
+bool Renderer::loadCheckpoint(int width, int height, Accumulator& acc, int& passes) const
+{
+    FILE* fp = fopen(checkpointFile.c_str(), "rb");
+    if (!fp)
+        return false;
+    size_t n = size_t(width) * height;
+    char magic[4];
+    uint32_t version, settings[kCheckpointSettings], expected[kCheckpointSettings], saved;
+    checkpointSettings(*this, width, height, expected);
+    bool ok = fread(magic, 1, 4, fp) == 4 && fread(&version, sizeof(uint32_t), 1, fp) == 1 &&
+              fread(settings, sizeof(uint32_t), kCheckpointSettings, fp) == kCheckpointSettings &&
+              fread(&saved, sizeof(uint32_t), 1, fp) == 1 && memcmp(magic, kCheckpointMagic, 4) == 0 &&
+              version == kCheckpointVersion && memcmp(settings, expected, sizeof(settings)) == 0;
+    std::vector<float> data(n * 3), albedo(n * 3), normal(n * 3);
+    std::vector<float> lumSqSum(n), depth(n);
+    std::vector<uint32_t> count(n);
+    ok = ok && fread(data.data(), sizeof(float), data.size(), fp) == data.size() &&
+         fread(lumSqSum.data(), sizeof(float), n, fp) == n && fread(count.data(), sizeof(uint32_t), n, fp) == n &&
+         fread(albedo.data(), sizeof(float), n * 3, fp) == n * 3 &&
+         fread(normal.data(), sizeof(float), n * 3, fp) == n * 3 && fread(depth.data(), sizeof(float), n, fp) == n;
+    fclose(fp);
+    if (!ok) {
+        std::cerr << "Ignoring checkpoint " << checkpointFile << ": unreadable or made with other settings\n";
+        return false;
+    }
+    acc.sum = unflatten(data);
+    acc.lumSqSum = std::move(lumSqSum);
+    acc.count = std::move(count);
+    acc.aux.albedo = unflatten(albedo);
+    acc.aux.normal = unflatten(normal);
+    acc.aux.depth = std::move(depth);
+    passes = saved;
+    return true;
+}
+
+bool Renderer::saveCheckpoint(int width, int height, const Accumulator& acc, int passes) const
+{
+    // written next to the old one and renamed, so an interruption never leaves a broken file
+    std::string tmp = checkpointFile + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+        return false;
+    size_t n = acc.sum.size();
+    uint32_t settings[kCheckpointSettings], saved = passes;
+    checkpointSettings(*this, width, height, settings);
+    std::vector<float> data = flatten(acc.sum), albedo = flatten(acc.aux.albedo), normal = flatten(acc.aux.normal);
+    bool ok = fwrite(kCheckpointMagic, 1, 4, fp) == 4 && fwrite(&kCheckpointVersion, sizeof(uint32_t), 1, fp) == 1 &&
+              fwrite(settings, sizeof(uint32_t), kCheckpointSettings, fp) == kCheckpointSettings &&
+              fwrite(&saved, sizeof(uint32_t), 1, fp) == 1 &&
+              fwrite(data.data(), sizeof(float), data.size(), fp) == data.size() &&
+              fwrite(acc.lumSqSum.data(), sizeof(float), n, fp) == n &&
+              fwrite(acc.count.data(), sizeof(uint32_t), n, fp) == n &&
+              fwrite(albedo.data(), sizeof(float), n * 3, fp) == n * 3 &&
+              fwrite(normal.data(), sizeof(float), n * 3, fp) == n * 3 &&
+              fwrite(acc.aux.depth.data(), sizeof(float), n, fp) == n;
+    ok = fclose(fp) == 0 && ok;
+    return ok && std::rename(tmp.c_str(), checkpointFile.c_str()) == 0;
+}
+
+// file with suffix added to its name, before the extension
+static std::string withSuffix(const std::string& file, const std::string& suffix)
+{
+    size_t dot = file.find_last_of('.'), slash = file.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return file + suffix;
+    return file.substr(0, dot) + suffix + file.substr(dot);
+}
+
+// Adds what the camera ray of a sample of pixel k hit to the auxiliary sums
+static void addAux(AuxBuffers& aux, int k, const Intersection& hit)
+{
+    if (!hit.happened)
+        return;
+    aux.albedo[k] += hit.m->getAlbedo();
+    aux.normal[k] += hit.normal;
+    aux.depth[k] += hit.distance;
+}
+
+// Mean over the pixels of a tile of the standard error of their luminance estimate,
+// relative to the estimate (dark pixels are measured against 0.01 instead)
+float Renderer::tileError(int width, int height, int tx, int ty, const Accumulator& acc) const
+{
+    int x1 = std::min(width, (tx + 1) * tileSize), y1 = std::min(height, (ty + 1) * tileSize);
+    double error = 0;
+    int pixels = 0;
+    for (int j = ty * tileSize; j < y1; ++j) {
+        for (int i = tx * tileSize; i < x1; ++i, ++pixels) {
+            int k = j * width + i;
+            float n = acc.count[k];
+            if (n < 2)
+                return std::numeric_limits<float>::infinity();
+            float mean = luminance(acc.sum[k]) / n;
+            float variance = std::max(0.f, (acc.lumSqSum[k] - mean * mean * n) / (n - 1));
+            error += std::sqrt(variance / n) / std::max(mean, 0.01f);
+        }
+    }
+    return pixels > 0 ? float(error / pixels) : 0.f;
+}
+
 // The main render function. This where we iterate over all pixels in the image,
 // generate primary rays and cast these rays into the scene. The content of the
 // framebuffer is saved to a file.
 void Renderer::Render(const Scene& scene)
 {
-    std::vector<Vector3f> framebuffer(scene.width * scene.height);
+    int numPixels = scene.width * scene.height;
+    Accumulator acc;
+    acc.sum.resize(numPixels);
+    acc.lumSqSum.resize(numPixels);
+    acc.count.resize(numPixels);
+    acc.aux.albedo.resize(numPixels);
+    acc.aux.normal.resize(numPixels);
+    acc.aux.depth.resize(numPixels);
+    std::vector<Vector3f> framebuffer(numPixels);
 
-    float scale = tan(deg2rad(scene.fov * 0.5));
-    float imageAspectRatio = scene.width / (float)scene.height;
-    Vector3f eye_pos(278, 273, -800);
-    int m = 0;
-
-    // change the spp value to change sample ammount
-    int spp = 16;
+    int passes = 0;
+    if (!checkpointFile.empty() && loadCheckpoint(scene.width, scene.height, acc, passes))
+        std::cout << "Resuming from " << checkpointFile << " at pass " << passes << "\n";
     std::cout << "SPP: " << spp << "\n";
 
-    #pragma omp parallel for
-    for (int j = 0; j < scene.height; ++j) {
-        for (int i = 0; i < scene.width; ++i) {
-            // generate primary ray direction
-            float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-                      imageAspectRatio * scale;
-            float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
+    // tiles still being sampled; without adaptive sampling every tile stops at spp
+    int tilesX = (scene.width + tileSize - 1) / tileSize, tilesY = (scene.height + tileSize - 1) / tileSize;
+    std::vector<int> activeTiles;
+    std::vector<int> inactivePerRow(tilesY);
+    auto updateTiles = [&]() {
+        activeTiles.clear();
+        for (int ty = 0; ty < tilesY; ++ty) {
+            inactivePerRow[ty] = 0;
+            for (int tx = 0; tx < tilesX; ++tx) {
+                int samples = acc.count[ty * tileSize * scene.width + tx * tileSize];
+                bool on = samples < spp;
+                if (on && adaptiveThreshold > 0 && samples >= adaptiveMinSpp)
+                    on = tileError(scene.width, scene.height, tx, ty, acc) >= adaptiveThreshold;
+                if (on)
+                    activeTiles.push_back(ty * tilesX + tx);
+                else
+                    ++inactivePerRow[ty];
+            }
+        }
+        return int(activeTiles.size());
+    };
+
+    // with denoising the rendered image is not the final one
+    const std::string noisyFile = denoise ? withSuffix(outputFile, "_noisy") : outputFile;
+
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+    bool outputWritten = false;
+    long long samplesTaken = 0;
+    ExtendStats extendStats;
+
+    while (updateTiles() > 0 && (timeBudget <= 0 || elapsed() < timeBudget)) {
+        int pass = passes;
+        bool last = pass + 1 == spp;
+        bool preview = previewInterval > 0 && (pass + 1) % previewInterval == 0;
+
+        // on output passes rows are saved as soon as they are finished; the 8-bit formats
+        // are gamma corrected, .pfm/.exr keep the linear radiance
+        std::unique_ptr<ImageWriter> writer;
+        if (last || preview)
+            writer.reset(new ImageWriter(last ? noisyFile : outputFile, scene.width, scene.height, 0.6f));
+
+        if (wavefront) {
+            // The pass goes in waves of whole rows of tiles, of at least wavefrontSize pixels
+            // (the last one aside), and the rows of a wave are written once it is done.
+            std::vector<int> pixels;
+            size_t next = 0;
+            for (int ty = 0, firstRow = 0; ty < tilesY; ++ty) {
+                for (; next < activeTiles.size() && activeTiles[next] / tilesX == ty; ++next) {
+                    int x0 = activeTiles[next] % tilesX * tileSize, y0 = ty * tileSize;
+                    for (int j = y0; j < std::min(scene.height, y0 + tileSize); ++j)
+                        for (int i = x0; i < std::min(scene.width, x0 + tileSize); ++i)
+                            pixels.push_back(j * scene.width + i);
+                }
+                if (ty + 1 < tilesY && int(pixels.size()) < wavefrontSize)
+                    continue;
+                wavefrontPass(scene, pixels, acc, framebuffer, extendStats);
+                samplesTaken += pixels.size();
+                pixels.clear();
+                int y0 = firstRow * tileSize, y1 = std::min(scene.height, (ty + 1) * tileSize);
+                if (writer)
+                    writer->writeRows(y0, y1 - y0, &framebuffer[y0 * scene.width]);
+                firstRow = ty + 1;
+                UpdateProgress((pass + (ty + 1) / float(tilesY)) / spp);
+            }
+        }
+        else {
+            // Tiles are handed out dynamically, since their cost varies a lot (the light, the
+            // boxes, converged tiles). Each thread renders a tile into its own buffer and merges
+            // it afterwards; tiles do not overlap, so merging needs no locking. A row of tiles
+            // is written out by the thread that finishes its last tile.
+            auto writeTileRow = [&](int ty) {
+                int y0 = ty * tileSize, rows = std::min(tileSize, scene.height - y0);
+                #pragma omp critical
+                writer->writeRows(y0, rows, &framebuffer[y0 * scene.width]);
+            };
+            std::unique_ptr<std::atomic<int>[]> tilesLeftInRow(new std::atomic<int>[tilesY]);
+            for (int ty = 0; ty < tilesY; ++ty) {
+                tilesLeftInRow[ty] = tilesX - inactivePerRow[ty];
+                if (writer && tilesLeftInRow[ty] == 0)
+                    writeTileRow(ty);
+            }
+            std::atomic<int> tilesDone{0};
+            int tilesReported = 0;
+            int numTiles = activeTiles.size();
+
+            // camera rays go in blocks of block x block pixels, traced as packets
+            int block = std::max(1, std::min(packetSize, 8));
 
-            Vector3f dir = normalize(Vector3f(-x, y, 1));
-            for (int k = 0; k < spp; k++){
-                framebuffer[j * scene.width + i] += scene.castRay(Ray(eye_pos, dir), 0) / spp;
+            #pragma omp parallel reduction(+ : samplesTaken)
+            {
+                Sampler& sampler = Sampler::current();
+                sampler.setup(sampleMode, spp, seed);
+                std::vector<Vector3f> tileL(tileSize * tileSize);
+                std::vector<float> tileLumSq(tileSize * tileSize);
+                std::vector<Ray> rays;
+                std::vector<Sampler> raySamplers(block * block);
+                std::vector<Intersection> hits(block * block);
+                RayPacket packet;
+
+                #pragma omp for schedule(dynamic, 1) nowait
+                for (int t = 0; t < numTiles; ++t) {
+                    int tx = activeTiles[t] % tilesX, ty = activeTiles[t] / tilesX;
+                    int x0 = tx * tileSize, y0 = ty * tileSize;
+                    int x1 = std::min(scene.width, x0 + tileSize), y1 = std::min(scene.height, y0 + tileSize);
+                    for (int by = y0; by < y1; by += block) {
+                        for (int bx = x0; bx < x1; bx += block) {
+                            int bx1 = std::min(x1, bx + block), by1 = std::min(y1, by + block);
+                            rays.clear();
+                            for (int j = by; j < by1; ++j) {
+                                for (int i = bx; i < bx1; ++i) {
+                                    sampler.startPixel(i, j);
+                                    sampler.startSample(acc.count[j * scene.width + i]);
+                                    rays.push_back(cameraRay(scene, i, j));
+                                    raySamplers[rays.size() - 1] = sampler;
+                                }
+                            }
+                            int n = rays.size();
+                            std::fill(hits.begin(), hits.begin() + n, Intersection());
+                            if (packets) {
+                                packet.size = n;
+                                for (int k = 0; k < n; ++k)
+                                    packet.set(k, rays[k]);
+                                scene.intersect(packet, hits.data());
+                            }
+                            else {
+                                for (int k = 0; k < n; ++k)
+                                    hits[k] = scene.intersect(rays[k]);
+                            }
+                            for (int k = 0; k < n; ++k) {
+                                int i = bx + k % (bx1 - bx), j = by + k / (bx1 - bx);
+                                sampler = raySamplers[k];
+                                addAux(acc.aux, j * scene.width + i, hits[k]);
+                                Vector3f L = scene.castRay(rays[k], hits[k], 0);
+                                float lum = luminance(L);
+                                tileL[(j - y0) * tileSize + i - x0] = L;
+                                tileLumSq[(j - y0) * tileSize + i - x0] = lum * lum;
+                            }
+                        }
+                    }
+                    for (int j = y0; j < y1; ++j) {
+                        for (int i = x0; i < x1; ++i) {
+                            int k = j * scene.width + i;
+                            acc.sum[k] += tileL[(j - y0) * tileSize + i - x0];
+                            acc.lumSqSum[k] += tileLumSq[(j - y0) * tileSize + i - x0];
+                            ++acc.count[k];
+                            framebuffer[k] = acc.sum[k] / acc.count[k];
+                        }
+                    }
+                    samplesTaken += (x1 - x0) * (y1 - y0);
+
+                    if (writer && --tilesLeftInRow[ty] == 0)
+                        writeTileRow(ty);
+                    // whichever thread finishes a tile reports, unless a later count is out already
+                    int done = ++tilesDone;
+                    #pragma omp critical(progress)
+                    if (done > tilesReported) {
+                        tilesReported = done;
+                        UpdateProgress((pass + done / float(numTiles)) / spp);
+                    }
+                }
             }
         }
-        UpdateProgress(m++ / (float)scene.height);
+        passes = pass + 1;
+        if (writer)
+            writer->close();
+        // a preview goes to outputFile, which is not the noisy image when denoising
+        outputWritten = last;
+        if (preview && !checkpointFile.empty() && !saveCheckpoint(scene.width, scene.height, acc, passes))
+            std::cerr << "Could not write checkpoint " << checkpointFile << "\n";
     }
     UpdateProgress(1.f);
+    std::cout << "\n" << passes << " passes, " << samplesTaken / double(numPixels) << " spp on average, "
+              << elapsed() << " s\n";
+    if (wavefront) {
+        const char* names[3] = {"camera rays", "bounce 1", "bounces 2+"};
+        std::cout << "Extend" << (sortRays ? " (sorted rays):" : ":");
+        for (int k = 0; k < 3; ++k)
+            std::cout << (k ? ", " : " ") << names[k] << " "
+                      << extendStats.rays[k] / std::max(1e-9, extendStats.seconds[k]) / 1e6 << " Mrays/s";
+        std::cout << "\n";
+    }
 
-    // save framebuffer to file
-    FILE* fp = fopen("binary.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    for (auto i = 0; i < scene.height * scene.width; ++i) {
-        static unsigned char color[3];
-        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
-        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
-        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
-        fwrite(color, 1, 3, fp);
+    if (!checkpointFile.empty() && !saveCheckpoint(scene.width, scene.height, acc, passes))
+        std::cerr << "Could not write checkpoint " << checkpointFile << "\n";
+    if (!outputWritten) {
+        // stopped early (time budget, converged tiles) or resumed from a finished checkpoint
+        for (int k = 0; k < numPixels; ++k)
+            framebuffer[k] = acc.count[k] > 0 ? acc.sum[k] / acc.count[k] : Vector3f(0.f);
+        writeImage(noisyFile, scene.width, scene.height, framebuffer, 0.6f);
+    }
+
+    if (!denoise && !writeAux)
+        return;
+    AuxBuffers aux;
+    aux.albedo.resize(numPixels);
+    aux.normal.resize(numPixels);
+    aux.depth.resize(numPixels);
+    std::vector<float> variance(numPixels);
+    float maxDepth = 0;
+    for (int k = 0; k < numPixels; ++k) {
+        float n = std::max(1u, acc.count[k]);
+        aux.albedo[k] = acc.aux.albedo[k] / n;
+        aux.normal[k] = acc.aux.normal[k] / n;
+        aux.depth[k] = acc.aux.depth[k] / n;
+        maxDepth = std::max(maxDepth, aux.depth[k]);
+        // of the mean; with a single sample, its square stands for it
+        float mean = luminance(framebuffer[k]);
+        variance[k] = acc.count[k] > 1 ? std::max(0.f, (acc.lumSqSum[k] - mean * mean * n) / (n - 1)) / n : mean * mean;
+    }
+    if (denoise) {
+        auto denoiseStart = std::chrono::steady_clock::now();
+        std::vector<Vector3f> denoised = denoiser.run(scene.width, scene.height, framebuffer, variance, aux);
+        std::cout << "Denoise: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - denoiseStart).count()
+                  << " s\n";
+        writeImage(outputFile, scene.width, scene.height, denoised, 0.6f);
+    }
+    if (writeAux) {
+        std::vector<Vector3f> normal(numPixels), depth(numPixels);
+        for (int k = 0; k < numPixels; ++k) {
+            Vector3f N = aux.normal[k];
+            float len = N.norm();
+            normal[k] = len > 0 ? Vector3f(0.5f) + N / (2 * len) : Vector3f(0.f);
+            depth[k] = Vector3f(maxDepth > 0 ? aux.depth[k] / maxDepth : 0.f);
+        }
+        writeImage(withSuffix(outputFile, "_albedo"), scene.width, scene.height, aux.albedo);
+        writeImage(withSuffix(outputFile, "_normal"), scene.width, scene.height, normal);
+        writeImage(withSuffix(outputFile, "_depth"), scene.width, scene.height, depth);
+    }
+}
+
+// [comment]
+// State of the paths of a wavefront, one entry per path, stored as separate arrays so
+// that every stage only touches the fields it needs. Queues are lists of path indices.
+// [/comment]
+struct PathStates
+{
+    // current ray
+    std::vector<float> ox, oy, oz, dx, dy, dz;
+    // throughput, radiance gathered so far, pdf of the BSDF sample that made the ray
+    std::vector<float> betaR, betaG, betaB, LR, LG, LB, bsdfPdf;
+    std::vector<int> pixel;
+    std::vector<Sampler> sampler;
+    std::vector<Intersection> hit;
+    // pending shadow ray and the radiance it brings if unoccluded
+    std::vector<char> hasShadow;
+    std::vector<float> sox, soy, soz, sdx, sdy, sdz, cR, cG, cB;
+    std::vector<double> stMax;
+    std::vector<char> alive;
+
+    void resize(size_t n)
+    {
+        for (auto v : {&ox, &oy, &oz, &dx, &dy, &dz, &betaR, &betaG, &betaB, &LR, &LG, &LB, &bsdfPdf,
+                       &sox, &soy, &soz, &sdx, &sdy, &sdz, &cR, &cG, &cB})
+            v->resize(n);
+        pixel.resize(n);
+        sampler.resize(n);
+        hit.resize(n);
+        hasShadow.resize(n);
+        stMax.resize(n);
+        alive.resize(n);
+    }
+
+    Ray ray(int p) const { return Ray(Vector3f(ox[p], oy[p], oz[p]), Vector3f(dx[p], dy[p], dz[p])); }
+    void setRay(int p, const Ray& r)
+    {
+        ox[p] = r.origin.x, oy[p] = r.origin.y, oz[p] = r.origin.z;
+        dx[p] = r.direction.x, dy[p] = r.direction.y, dz[p] = r.direction.z;
+    }
+    Vector3f beta(int p) const { return Vector3f(betaR[p], betaG[p], betaB[p]); }
+    void setBeta(int p, const Vector3f& b) { betaR[p] = b.x, betaG[p] = b.y, betaB[p] = b.z; }
+    void addL(int p, const Vector3f& c)
+    {
+        const Vector3f L = Vector3f(LR[p], LG[p], LB[p]) + c;
+        LR[p] = L.x, LG[p] = L.y, LB[p] = L.z;
+    }
+};
+
+// [comment]
+// One sample for each of *pixels*, computed wavefront by wavefront. Every bounce runs
+//   extend: closest hit of every queued ray,
+//   shade:  emission, light sample and BSDF sample of every path that hit something
+//           (Scene::emitted, sampleDirect and scatter, the steps of castRay),
+//   shadow: occlusion test of the light samples,
+// then the surviving paths form the next queue (sorted first if sortRays is set);
+// finished paths are accumulated at the end. Each path carries its own Sampler, so it
+// sees the same random numbers, and the image is the same, as when castRay traces it.
+// [/comment]
+void Renderer::wavefrontPass(const Scene& scene, const std::vector<int>& pixels, Accumulator& acc,
+                             std::vector<Vector3f>& framebuffer, ExtendStats& stats) const
+{
+    int chunk = std::max(1, wavefrontSize);
+    PathStates paths;
+    paths.resize(std::min<size_t>(chunk, pixels.size()));
+    std::vector<int> queue, hitQueue;
+    std::vector<uint64_t> keys;
+    const Bounds3 sceneBounds = scene.bvh->WorldBound();
+
+    for (size_t first = 0; first < pixels.size(); first += chunk) {
+        int n = std::min<size_t>(chunk, pixels.size() - first);
+
+        // generate
+        #pragma omp parallel for
+        for (int p = 0; p < n; ++p) {
+            int k = pixels[first + p];
+            Sampler& sampler = Sampler::current();
+            sampler.setup(sampleMode, spp, seed);
+            sampler.startPixel(k % scene.width, k / scene.width);
+            sampler.startSample(acc.count[k]);
+            paths.setRay(p, cameraRay(scene, k % scene.width, k / scene.width));
+            paths.sampler[p] = sampler;
+            paths.pixel[p] = k;
+            paths.setBeta(p, Vector3f(1.f));
+            paths.LR[p] = paths.LG[p] = paths.LB[p] = 0;
+            paths.bsdfPdf[p] = 0;
+        }
+        queue.resize(n);
+        for (int p = 0; p < n; ++p)
+            queue[p] = p;
+
+        for (int bounce = 0; !queue.empty(); ++bounce) {
+            // extend
+            auto extendStart = std::chrono::steady_clock::now();
+            int queued = queue.size();
+            if (sortRays && bounce > 0) {
+                // key: origin Morton code (30 bits), direction octant (3 bits), path (31 bits)
+                keys.resize(queued);
+                #pragma omp parallel for
+                for (int q = 0; q < queued; ++q) {
+                    int p = queue[q];
+                    uint64_t octant = (paths.dx[p] < 0) << 2 | (paths.dy[p] < 0) << 1 | (paths.dz[p] < 0);
+                    uint64_t code = mortonCode(sceneBounds.Offset(Vector3f(paths.ox[p], paths.oy[p], paths.oz[p])));
+                    keys[q] = code << 34 | octant << 31 | uint64_t(p);
+                }
+                std::sort(keys.begin(), keys.end());
+                for (int q = 0; q < queued; ++q)
+                    queue[q] = int(keys[q] & 0x7fffffff);
+            }
+            if (packets && bounce == 0) {
+                // consecutive camera rays are pixels of the same tile
+                const int size = RayPacket::kMaxSize;
+                #pragma omp parallel for schedule(dynamic, 4)
+                for (int b = 0; b < (queued + size - 1) / size; ++b) {
+                    RayPacket packet;
+                    Intersection hits[size];
+                    packet.size = std::min(size, queued - b * size);
+                    for (int k = 0; k < packet.size; ++k)
+                        packet.set(k, paths.ray(queue[b * size + k]));
+                    scene.intersect(packet, hits);
+                    for (int k = 0; k < packet.size; ++k)
+                        paths.hit[queue[b * size + k]] = hits[k];
+                }
+            }
+            else {
+                #pragma omp parallel for schedule(dynamic, 256)
+                for (int q = 0; q < queued; ++q)
+                    paths.hit[queue[q]] = scene.intersect(paths.ray(queue[q]));
+            }
+            int depth = std::min(bounce, 2);
+            stats.rays[depth] += queued;
+            stats.seconds[depth] += std::chrono::duration<double>(std::chrono::steady_clock::now() - extendStart).count();
+            if (bounce == 0) {
+                #pragma omp parallel for
+                for (int q = 0; q < queued; ++q)
+                    addAux(acc.aux, paths.pixel[queue[q]], paths.hit[queue[q]]);
+            }
+
+            // paths that missed are finished
+            hitQueue.clear();
+            for (int p : queue)
+                if (paths.hit[p].happened)
+                    hitQueue.push_back(p);
+            int hits = hitQueue.size();
+
+            // shade
+            #pragma omp parallel for schedule(dynamic, 256)
+            for (int q = 0; q < hits; ++q) {
+                int p = hitQueue[q];
+                Sampler& sampler = Sampler::current();
+                sampler = paths.sampler[p];
+                const Intersection& isect = paths.hit[p];
+                Ray r = paths.ray(p);
+                Vector3f beta = paths.beta(p);
+                paths.addL(p, scene.emitted(r, isect, beta, paths.bsdfPdf[p]));
+
+                Ray shadowRay(isect.coords, isect.normal);
+                Vector3f contribution;
+                paths.hasShadow[p] = scene.sampleDirect(r, isect, beta, shadowRay, contribution);
+                if (paths.hasShadow[p]) {
+                    paths.sox[p] = shadowRay.origin.x, paths.soy[p] = shadowRay.origin.y, paths.soz[p] = shadowRay.origin.z;
+                    paths.sdx[p] = shadowRay.direction.x, paths.sdy[p] = shadowRay.direction.y, paths.sdz[p] = shadowRay.direction.z;
+                    paths.stMax[p] = shadowRay.t_max;
+                    paths.cR[p] = contribution.x, paths.cG[p] = contribution.y, paths.cB[p] = contribution.z;
+                }
+
+                paths.alive[p] = scene.scatter(r, isect, bounce, beta, paths.bsdfPdf[p]);
+                paths.setRay(p, r);
+                paths.setBeta(p, beta);
+                paths.sampler[p] = sampler;
+            }
+
+            // shadow
+            #pragma omp parallel for schedule(dynamic, 256)
+            for (int q = 0; q < hits; ++q) {
+                int p = hitQueue[q];
+                if (!paths.hasShadow[p])
+                    continue;
+                Ray shadowRay(Vector3f(paths.sox[p], paths.soy[p], paths.soz[p]),
+                              Vector3f(paths.sdx[p], paths.sdy[p], paths.sdz[p]));
+                shadowRay.t_max = paths.stMax[p];
+                if (!scene.intersectP(shadowRay))
+                    paths.addL(p, Vector3f(paths.cR[p], paths.cG[p], paths.cB[p]));
+            }
+
+            // surviving paths
+            queue.clear();
+            for (int p : hitQueue)
+                if (paths.alive[p])
+                    queue.push_back(p);
+        }
+
+        // accumulate; pixels are distinct, so this needs no synchronization
+        #pragma omp parallel for
+        for (int p = 0; p < n; ++p) {
+            int k = paths.pixel[p];
+            const Vector3f L(paths.LR[p], paths.LG[p], paths.LB[p]);
+            float lum = luminance(L);
+            acc.sum[k] += L;
+            acc.lumSqSum[k] += lum * lum;
+            ++acc.count[k];
+            framebuffer[k] = acc.sum[k] / acc.count[k];
+        }
     }
-    fclose(fp);
 }
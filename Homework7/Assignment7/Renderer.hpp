@@ -1,7 +1,9 @@
 //
 // Created by goksu on 2/25/20.
 //
+#include <string>
 #include "Scene.hpp"
+#include "Denoiser.hpp"
 
 #pragma once
 struct hit_payload
@@ -17,5 +19,99 @@ class Renderer
 public:
     void Render(const Scene& scene);
 
+    // The format is picked from the extension: .ppm, .png, .pfm or .exr (half float)
+    std::string outputFile = "binary.ppm";
+
+    // Random numbers are seeded per pixel, so the same settings give the same image
+    SampleMode sampleMode = SampleMode::Random;
+    uint64_t seed = 0;
+
+    // [comment]
+    // Progressive rendering: every pass adds one sample to each pixel, until spp samples
+    // are reached or timeBudget seconds (if > 0) have passed. Every previewInterval passes
+    // (if > 0) the current estimate is written to outputFile and, if checkpointFile is
+    // set, the accumulated sums are saved there. An existing checkpoint made with the same
+    // resolution, spp, sampling and adaptive settings is loaded at start, so an
+    // interrupted render resumes where it stopped.
+    // [/comment]
+    int spp = 16;
+    double timeBudget = 0;
+    int previewInterval = 0;
+    std::string checkpointFile;
+
+    // [comment]
+    // Adaptive sampling (enabled when adaptiveThreshold > 0): the image is split into
+    // tileSize x tileSize tiles, and once a tile has adaptiveMinSpp samples per pixel it
+    // only keeps being sampled while its error estimate, the mean over its pixels of
+    // the relative standard error of the luminance, is above adaptiveThreshold. spp
+    // then is the per-pixel maximum.
+    // [/comment]
+    float adaptiveThreshold = 0;
+    int adaptiveMinSpp = 8;
+    int tileSize = 16;
+
+    // [comment]
+    // Wavefront mode: instead of tracing each path to completion, a pass is run
+    // wavefrontSize paths at a time, one bounce at a time, as separate stages (extend,
+    // shade, shadow, accumulate) over queues of path indices. The image is the same as in
+    // the default mode.
+    // [/comment]
+    bool wavefront = false;
+    int wavefrontSize = 1 << 16;
+
+    // [comment]
+    // Ray sorting (wavefront mode): from the second bounce on, where the rays of
+    // neighbouring paths have scattered apart, the queue is sorted along the Morton curve
+    // of the ray origins, and by the octant of the directions within a cell, before the
+    // rays are traced, so that consecutive rays take similar paths through the BVH. The
+    // larger wavefrontSize, the more rays share a cell.
+    // [/comment]
+    bool sortRays = false;
+
+    // [comment]
+    // Camera rays are jittered over their pixel and traced as packets (see
+    // BVHAccel::IntersectPacket): the pixels of a tile are taken in blocks of packetSize x
+    // packetSize (at most 8 x 8), and in wavefront mode runs of consecutive camera rays,
+    // which are pixels of the same tile, form the packets. With packets false the camera
+    // rays are traced one by one, giving the same image.
+    // [/comment]
+    bool packets = true;
+    int packetSize = 8;
+
+    // [comment]
+    // The camera rays also record, per pixel, the average albedo, normal and depth of what
+    // they hit (see AuxBuffers). With denoise set, the final image is filtered by denoiser,
+    // guided by them and by the variance of the pixel estimates, and the unfiltered image
+    // is written next to it with "_noisy" added to the file name. writeAux writes the
+    // buffers the same way, as "_albedo", "_normal" (0.5 + N / 2) and "_depth" (divided by
+    // the largest depth).
+    // [/comment]
+    bool denoise = false;
+    Denoiser denoiser;
+    bool writeAux = false;
+
 private:
+    // Running per-pixel estimates: sums of the samples and of their squared luminance,
+    // and sums of the auxiliary buffers over the samples
+    struct Accumulator
+    {
+        std::vector<Vector3f> sum;
+        std::vector<float> lumSqSum;
+        std::vector<uint32_t> count;
+        AuxBuffers aux;
+    };
+
+    // Rays traced by the extend stages of wavefront passes and their time, for camera rays,
+    // first bounce and later bounces
+    struct ExtendStats
+    {
+        long long rays[3] = {};
+        double seconds[3] = {};
+    };
+
+    bool loadCheckpoint(int width, int height, Accumulator& acc, int& passes) const;
+    bool saveCheckpoint(int width, int height, const Accumulator& acc, int passes) const;
+    float tileError(int width, int height, int tx, int ty, const Accumulator& acc) const;
+    void wavefrontPass(const Scene& scene, const std::vector<int>& pixels, Accumulator& acc,
+                       std::vector<Vector3f>& framebuffer, ExtendStats& stats) const;
 };
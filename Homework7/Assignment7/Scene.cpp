@@ -7,7 +7,41 @@
 
 void Scene::buildBVH() {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh.reset(new BVHAccel(objects, 1, BVHAccel::SplitMethod::SAH));
+    buildLightTable();
+}
+
+void Scene::refitBVH()
+{
+    if (!bvh || bvh->refit() > BVHAccel::kMaxRefitCostGrowth)
+        buildBVH();
+    else
+        buildLightTable(); // emissive meshes may have been built again, and their areas changed
+}
+
+void Scene::buildLightTable()
+{
+    emitters.clear();
+    for (auto object : objects)
+        object->collectEmitters(emitters);
+
+    std::vector<float> weights;
+    for (auto emitter : emitters) {
+        float w = emitter->getArea();
+        if (lightSelection == LightSelection::Power) {
+            // the emission is uniform over a primitive, so any sample point gives it
+            Intersection pos;
+            float pdf;
+            emitter->Sample(pos, pdf);
+            w *= 0.2126f * pos.emit.x + 0.7152f * pos.emit.y + 0.0722f * pos.emit.z;
+        }
+        weights.push_back(w);
+    }
+    emitterTable = AliasTable(weights);
+
+    emitterAreaPdf.clear();
+    for (int k = 0; k < emitterTable.size(); ++k)
+        emitterAreaPdf[emitters[k]] = emitterTable.pmf(k) / emitters[k]->getArea();
 }
 
 Intersection Scene::intersect(const Ray &ray) const
@@ -15,25 +49,37 @@ Intersection Scene::intersect(const Ray &ray) const
     return this->bvh->Intersect(ray);
 }
 
+bool Scene::intersectP(const Ray &ray) const
+{
+    return this->bvh->IntersectP(ray);
+}
+
+void Scene::intersect(RayPacket &packet, Intersection *hits) const
+{
+    this->bvh->IntersectPacket(packet, hits);
+}
+
 void Scene::sampleLight(Intersection &pos, float &pdf) const
 {
-    float emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-        }
-    }
-    float p = get_random_float() * emit_area_sum;
-    emit_area_sum = 0;
-    for (uint32_t k = 0; k < objects.size(); ++k) {
-        if (objects[k]->hasEmit()){
-            emit_area_sum += objects[k]->getArea();
-            if (p <= emit_area_sum){
-                objects[k]->Sample(pos, pdf);
-                break;
-            }
-        }
-    }
+    pdf = 0;
+    if (emitterTable.empty())
+        return;
+    int k = emitterTable.sample(get_random_float());
+    emitters[k]->Sample(pos, pdf);
+    pdf *= emitterTable.pmf(k);
+}
+
+// Area density with which sampleLight() picks points on *emitter*
+float Scene::emitterPdf(const Object *emitter) const
+{
+    auto it = emitterAreaPdf.find(emitter);
+    return it == emitterAreaPdf.end() ? 0.f : it->second;
+}
+
+static float powerHeuristic(float pdfA, float pdfB)
+{
+    float a = pdfA * pdfA, b = pdfB * pdfB;
+    return a + b > 0 ? a / (a + b) : 0.f;
 }
 
 bool Scene::trace(
@@ -57,30 +103,98 @@ bool Scene::trace(
     return (*hitObject != nullptr);
 }
 
-// Implementation of Path Tracing
-Vector3f Scene::castRay(const Ray& ray, int depth) const
+// Emission seen at isect by the ray r, times the path throughput beta. For rays sampled
+// from a BSDF with density bsdfPdf it is weighted against light sampling, which could
+// have found it as well.
+Vector3f Scene::emitted(const Ray &r, const Intersection &isect, const Vector3f &beta, float bsdfPdf) const
 {
-    // TO DO Implement Path Tracing Algorithm here
-    Intersection isect = intersect(ray);
-    if (!isect.happened)
+    if (!isect.m->hasEmission())
         return Vector3f();
+    float w = 1;
+    if (bsdfPdf > 0) {
+        float cos_x = dotProduct(-r.direction, isect.normal);
+        float pdfLight = cos_x > 0 ? emitterPdf(isect.obj) * isect.distance * isect.distance / cos_x : 0;
+        w = powerHeuristic(bsdfPdf, pdfLight);
+    }
+    return beta * isect.m->getEmission() * w;
+}
 
-    Vector3f L_dir, L_indir;
+// Light sampling at the vertex isect reached by r. Returns false when the sample cannot
+// contribute; otherwise the contribution (throughput beta included, weighted against
+// BSDF sampling) is to be added if shadowRay, which stops just short of the light
+// sample, is not occluded.
+bool Scene::sampleDirect(const Ray &r, const Intersection &isect, const Vector3f &beta,
+                         Ray &shadowRay, Vector3f &contribution) const
+{
     Intersection isect_light;
     float pdf_light;
     sampleLight(isect_light, pdf_light);
+    if (pdf_light <= 0)
+        return false;
+    const Vector3f N = isect.normal;
+    Vector3f p_x = isect_light.coords - isect.coords;
+    float dist = p_x.norm();
+    Vector3f ws = p_x / dist;
+    float cos_p = dotProduct(ws, N), cos_x = dotProduct(-ws, isect_light.normal);
+    if (cos_p <= 0 || cos_x <= 0)
+        return false;
+    shadowRay = Ray(isect.coords, ws);
+    shadowRay.t_max = dist * (1 - 1e-4);
+    float pdfLight = pdf_light * dist * dist / cos_x;
+    float w = powerHeuristic(pdfLight, isect.m->pdf(r.direction, ws, N));
+    contribution = beta * isect_light.emit * isect.m->eval(r.direction, ws, N) * (cos_p * w / pdfLight);
+    return true;
+}
+
+// BSDF sampling for the next vertex, followed by Russian roulette past
+// russianRouletteDepth bounces. Returns false when the path ends; otherwise r is the
+// next ray, sampled with density bsdfPdf, and beta the updated throughput.
+bool Scene::scatter(Ray &r, const Intersection &isect, int bounce, Vector3f &beta, float &bsdfPdf) const
+{
+    BSDFSample bs = isect.m->sampleBSDF(r.direction, isect.normal);
+    if (bs.pdf <= 0)
+        return false;
+    beta = beta * bs.weight;
+    if (bounce >= russianRouletteDepth) {
+        float q = std::min(1.f, std::max(beta.x, std::max(beta.y, beta.z)));
+        if (get_random_float() >= q)
+            return false;
+        beta = beta / q;
+    }
+    r = Ray(isect.coords, bs.wo);
+    bsdfPdf = bs.pdf;
+    return true;
+}
+
+// Implementation of Path Tracing
+//
+// Iterative path tracer: the hit of each BSDF-sampled ray is the next path vertex, and
+// emitters are reached both by light sampling and by the BSDF rays, the two combined
+// with the power heuristic. Past russianRouletteDepth bounces paths are terminated with
+// a probability driven by their throughput.
+Vector3f Scene::castRay(const Ray& ray, int depth) const
+{
+    return castRay(ray, intersect(ray), depth);
+}
+
+Vector3f Scene::castRay(const Ray& ray, const Intersection& hit, int depth) const
+{
+    Vector3f L, beta(1.f);
+    Ray r = ray;
+    Intersection isect = hit;
+    float bsdfPdf = 0; // solid-angle pdf of the ray that found isect, 0 for camera rays
+
+    for (int bounce = depth; isect.happened; ++bounce) {
+        L += emitted(r, isect, beta, bsdfPdf);
+
+        Ray shadowRay(isect.coords, isect.normal);
+        Vector3f contribution;
+        if (sampleDirect(r, isect, beta, shadowRay, contribution) && !intersectP(shadowRay))
+            L += contribution;
 
-    Ray ray_p_x(isect.coords, (isect_light.coords - isect.coords).normalized());
-    Intersection isect_p_x = intersect(ray_p_x);
-    if (isect_p_x.happened && isect_p_x.m->hasEmission())
-        L_dir = isect_p_x.m->getEmission() * isect.m->eval(ray.direction, ray_p_x.direction, isect.normal) * dotProduct(ray_p_x.direction, isect.normal) * dotProduct(-ray_p_x.direction, isect_p_x.normal) / isect_p_x.distance / isect_p_x.distance / pdf_light;
-
-    if (get_random_float() < RussianRoulette) {
-        Vector3f dir_in = isect.m->sample(ray.direction, isect.normal).normalized();
-        Ray ray_in(isect.coords, dir_in);
-        Intersection isect_in = intersect(ray_in);
-        if (isect_in.happened && !isect_in.m->hasEmission())
-            L_indir = castRay(ray_in, depth + 1) * isect.m->eval(ray.direction, dir_in, isect.normal) * dotProduct(dir_in, isect.normal) / isect.m->pdf(ray.direction, dir_in, isect.normal) / RussianRoulette;
+        if (!scatter(r, isect, bounce, beta, bsdfPdf))
+            break;
+        isect = intersect(r);
     }
-    return isect.m->getEmission() + L_dir + L_indir;
+    return L;
 }
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <unordered_map>
 #include <vector>
 #include "Vector.hpp"
 #include "Object.hpp"
@@ -11,6 +12,7 @@
 #include "AreaLight.hpp"
 #include "BVH.hpp"
 #include "Ray.hpp"
+#include "AliasTable.hpp"
 
 
 class Scene
@@ -22,7 +24,11 @@ public:
     double fov = 40;
     Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
     int maxDepth = 1;
-    float RussianRoulette = 0.8;
+    // Paths longer than this are continued with probability max(throughput) (at most 1)
+    int russianRouletteDepth = 3;
+    // Emitters are picked proportionally to their area or to their power (area * luminance)
+    enum class LightSelection { Area, Power };
+    LightSelection lightSelection = LightSelection::Area;
 
     Scene(int w, int h) : width(w), height(h)
     {}
@@ -33,10 +39,27 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
-    BVHAccel *bvh;
+    bool intersectP(const Ray& ray) const;
+    // Closest hits of the rays of a packet of coherent rays (see BVHAccel::IntersectPacket)
+    void intersect(RayPacket& packet, Intersection* hits) const;
+    std::unique_ptr<BVHAccel> bvh;
+    // Builds the BVH over the objects; meshes keep their own BVHs (built when they are loaded),
+    // so this is cheap enough to call again after instances are moved.
     void buildBVH();
+    // After objects moved: refits the BVH (see BVHAccel::refit), or builds it again, and
+    // builds the light table again
+    void refitBVH();
+    void buildLightTable();
     Vector3f castRay(const Ray &ray, int depth) const;
+    // castRay for a ray whose closest hit is already known
+    Vector3f castRay(const Ray &ray, const Intersection &hit, int depth) const;
+    // Steps of castRay, also used on their own by the wavefront renderer
+    Vector3f emitted(const Ray &r, const Intersection &isect, const Vector3f &beta, float bsdfPdf) const;
+    bool sampleDirect(const Ray &r, const Intersection &isect, const Vector3f &beta,
+                      Ray &shadowRay, Vector3f &contribution) const;
+    bool scatter(Ray &r, const Intersection &isect, int bounce, Vector3f &beta, float &bsdfPdf) const;
     void sampleLight(Intersection &pos, float &pdf) const;
+    float emitterPdf(const Object *emitter) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
@@ -47,6 +70,11 @@ public:
     std::vector<Object* > objects;
     std::vector<std::unique_ptr<Light> > lights;
 
+    // Emissive primitives and the table sampleLight() picks them from, filled by buildLightTable()
+    std::vector<Object*> emitters;
+    AliasTable emitterTable;
+    std::unordered_map<const Object*, float> emitterAreaPdf; // pmf / area, for MIS
+
     // Compute reflection direction
     Vector3f reflect(const Vector3f &I, const Vector3f &N) const
     {
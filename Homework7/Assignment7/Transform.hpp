@@ -0,0 +1,122 @@
+#pragma once
+#include <cmath>
+#include "Bounds3.hpp"
+#include "Vector.hpp"
+#include "global.hpp"
+
+// [comment]
+// Affine transform given as a 4x4 matrix together with its inverse. Transforms are only
+// made by the factories below and by composing them, so the inverse is always known
+// and never has to be computed.
+// [/comment]
+class Transform
+{
+public:
+    struct Matrix
+    {
+        float e[4][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}};
+
+        Matrix operator*(const Matrix& b) const
+        {
+            Matrix r;
+            for (int i = 0; i < 4; ++i)
+                for (int j = 0; j < 4; ++j)
+                    r.e[i][j] = e[i][0] * b.e[0][j] + e[i][1] * b.e[1][j] + e[i][2] * b.e[2][j] + e[i][3] * b.e[3][j];
+            return r;
+        }
+    };
+
+    Transform() = default;
+    Transform(const Matrix& m, const Matrix& inv) : m(m), inv(inv) {}
+
+    static Transform translate(const Vector3f& t)
+    {
+        Matrix m, inv;
+        m.e[0][3] = t.x, m.e[1][3] = t.y, m.e[2][3] = t.z;
+        inv.e[0][3] = -t.x, inv.e[1][3] = -t.y, inv.e[2][3] = -t.z;
+        return Transform(m, inv);
+    }
+
+    static Transform scale(const Vector3f& s)
+    {
+        Matrix m, inv;
+        m.e[0][0] = s.x, m.e[1][1] = s.y, m.e[2][2] = s.z;
+        inv.e[0][0] = 1 / s.x, inv.e[1][1] = 1 / s.y, inv.e[2][2] = 1 / s.z;
+        return Transform(m, inv);
+    }
+
+    // Rotation by degrees around axis (right-handed)
+    static Transform rotate(float degrees, const Vector3f& axis)
+    {
+        const Vector3f a = normalize(axis);
+        const float rad = degrees * M_PI / 180, s = std::sin(rad), c = std::cos(rad);
+        Matrix m;
+        m.e[0][0] = a.x * a.x + (1 - a.x * a.x) * c;
+        m.e[0][1] = a.x * a.y * (1 - c) - a.z * s;
+        m.e[0][2] = a.x * a.z * (1 - c) + a.y * s;
+        m.e[1][0] = a.x * a.y * (1 - c) + a.z * s;
+        m.e[1][1] = a.y * a.y + (1 - a.y * a.y) * c;
+        m.e[1][2] = a.y * a.z * (1 - c) - a.x * s;
+        m.e[2][0] = a.x * a.z * (1 - c) - a.y * s;
+        m.e[2][1] = a.y * a.z * (1 - c) + a.x * s;
+        m.e[2][2] = a.z * a.z + (1 - a.z * a.z) * c;
+        // a rotation matrix is orthogonal: its inverse is its transpose
+        Matrix inv;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                inv.e[i][j] = m.e[j][i];
+        return Transform(m, inv);
+    }
+
+    // Applies t first, then this transform
+    Transform operator*(const Transform& t) const { return Transform(m * t.m, t.inv * inv); }
+    Transform inverse() const { return Transform(inv, m); }
+
+    Vector3f point(const Vector3f& p) const
+    {
+        return Vector3f(m.e[0][0] * p.x + m.e[0][1] * p.y + m.e[0][2] * p.z + m.e[0][3],
+                        m.e[1][0] * p.x + m.e[1][1] * p.y + m.e[1][2] * p.z + m.e[1][3],
+                        m.e[2][0] * p.x + m.e[2][1] * p.y + m.e[2][2] * p.z + m.e[2][3]);
+    }
+
+    Vector3f vector(const Vector3f& v) const
+    {
+        return Vector3f(m.e[0][0] * v.x + m.e[0][1] * v.y + m.e[0][2] * v.z,
+                        m.e[1][0] * v.x + m.e[1][1] * v.y + m.e[1][2] * v.z,
+                        m.e[2][0] * v.x + m.e[2][1] * v.y + m.e[2][2] * v.z);
+    }
+
+    // Normals go through the inverse transpose, so they stay perpendicular to the surface
+    // under non-uniform scaling; the result is not normalized.
+    Vector3f normal(const Vector3f& n) const
+    {
+        return Vector3f(inv.e[0][0] * n.x + inv.e[1][0] * n.y + inv.e[2][0] * n.z,
+                        inv.e[0][1] * n.x + inv.e[1][1] * n.y + inv.e[2][1] * n.z,
+                        inv.e[0][2] * n.x + inv.e[1][2] * n.y + inv.e[2][2] * n.z);
+    }
+
+    // Whether lengths are kept (rotations, reflections and translations), up to rounding
+    bool isRigid() const
+    {
+        for (int i = 0; i < 3; ++i)
+            for (int j = i; j < 3; ++j) {
+                float d = m.e[0][i] * m.e[0][j] + m.e[1][i] * m.e[1][j] + m.e[2][i] * m.e[2][j];
+                if (std::abs(d - (i == j)) > 1e-5f)
+                    return false;
+            }
+        return true;
+    }
+
+    // Box around the transformed corners of b
+    Bounds3 bounds(const Bounds3& b) const
+    {
+        Bounds3 r(point(b.pMin));
+        for (int k = 1; k < 8; ++k)
+            r = Union(r, point(Vector3f(k & 1 ? b.pMax.x : b.pMin.x, k & 2 ? b.pMax.y : b.pMin.y,
+                                        k & 4 ? b.pMax.z : b.pMin.z)));
+        return r;
+    }
+
+private:
+    Matrix m, inv;
+};
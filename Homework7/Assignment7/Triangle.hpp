@@ -1,13 +1,14 @@
 #pragma once
 
+#include "AliasTable.hpp"
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
+#include "MeshCache.hpp"
+#include "OBJ_Parser.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
 #include <cassert>
-#include <array>
 
 bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1,
                           const Vector3f& v2, const Vector3f& orig,
@@ -61,6 +62,7 @@ public:
     bool intersect(const Ray& ray) override;
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
+    bool intersectDistance(const Ray& ray, double& t) const;
     Intersection getIntersection(Ray ray) override;
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
@@ -76,6 +78,7 @@ public:
         float x = std::sqrt(get_random_float()), y = get_random_float();
         pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
         pos.normal = this->normal;
+        pos.emit = m->getEmission();
         pdf = 1.0f / area;
     }
     float getArea(){
@@ -89,72 +92,172 @@ public:
 class MeshTriangle : public Object
 {
 public:
-    MeshTriangle(const std::string& filename, Material *mt = new Material())
+    MeshTriangle(const std::string& filename, Material *mt = new Material(),
+                 BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::SAH)
     {
-        objl::Loader loader;
-        loader.LoadFile(filename);
         area = 0;
         m = mt;
-        assert(loader.LoadedMeshes.size() == 1);
-        auto mesh = loader.LoadedMeshes[0];
-
-        Vector3f min_vert = Vector3f{std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity(),
-                                     std::numeric_limits<float>::infinity()};
-        Vector3f max_vert = Vector3f{-std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity(),
-                                     -std::numeric_limits<float>::infinity()};
-        for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-            std::array<Vector3f, 3> face_vertices;
-
-            for (int j = 0; j < 3; j++) {
-                auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-                                     mesh.Vertices[i + j].Position.Y,
-                                     mesh.Vertices[i + j].Position.Z);
-                face_vertices[j] = vert;
-
-                min_vert = Vector3f(std::min(min_vert.x, vert.x),
-                                    std::min(min_vert.y, vert.y),
-                                    std::min(min_vert.z, vert.z));
-                max_vert = Vector3f(std::max(max_vert.x, vert.x),
-                                    std::max(max_vert.y, vert.y),
-                                    std::max(max_vert.z, vert.z));
-            }
-
-            triangles.emplace_back(face_vertices[0], face_vertices[1],
-                                   face_vertices[2], mt);
+        this->splitMethod = splitMethod;
+
+        // Emissive meshes keep their Triangle objects to be sampled, which are not cached
+        MeshCache::Key key;
+        bool cacheable = !hasEmit() && MeshCache::hashFile(filename, key);
+        key.params[0] = int32_t(splitMethod);
+        key.params[1] = TrianglePacket::kWidth;
+        key.params[2] = WideBVHNode::kWidth;
+        if (cacheable && loadCache(MeshCache::path(filename), key))
+            return;
+
+        objp::Mesh mesh;
+        objp::LoadFile(filename, mesh);
+        assert(!mesh.indices.empty());
+
+        numVertices = uint32_t(mesh.positions.size() / 3);
+        numTriangles = mesh.indices.size() / 3;
+        vertices.reset(new Vector3f[numVertices]);
+        stCoordinates.reset(new Vector2f[numVertices]);
+        for (size_t i = 0; i < numVertices; ++i) {
+            vertices[i] = Vector3f(mesh.positions[3 * i], mesh.positions[3 * i + 1], mesh.positions[3 * i + 2]);
+            if (!mesh.texcoords.empty())
+                stCoordinates[i] = Vector2f(mesh.texcoords[2 * i], mesh.texcoords[2 * i + 1]);
         }
+        vertexIndex.reset(new uint32_t[mesh.indices.size()]);
+        std::copy(mesh.indices.begin(), mesh.indices.end(), vertexIndex.get());
+
+        buildBVH();
+        if (cacheable)
+            saveCache(MeshCache::path(filename), key);
+    }
+
+    // Version of the layout of the cache files written by saveCache
+    static constexpr uint32_t kCacheVersion = 1;
+
+    // [comment]
+    // Loads the vertex data and the BVH (its 4-wide nodes and triangle packets) from the
+    // cache at path, if it was written for the same source file and build parameters.
+    // The arrays are copied out of the mapping, since refit() updates them in place.
+    // [/comment]
+    bool loadCache(const std::string& path, const MeshCache::Key& key)
+    {
+        MeshCache cache;
+        if (!cache.open(path, kCacheVersion, key))
+            return false;
+        size_t nVertices = 0, nSt = 0, nIndices = 0, nNodes = 0, nPackets = 0, nCosts = 0;
+        const Vector3f* v = cache.array<Vector3f>(nVertices);
+        const Vector2f* st = cache.array<Vector2f>(nSt);
+        const uint32_t* indices = cache.array<uint32_t>(nIndices);
+        const WideBVHNode* nodes = cache.array<WideBVHNode>(nNodes);
+        const TrianglePacket* packets = cache.array<TrianglePacket>(nPackets);
+        const double* costs = cache.array<double>(nCosts);
+        if (!v || !st || !indices || !nodes || !packets || !costs || nSt != nVertices || nCosts != 2)
+            return false;
+
+        numVertices = uint32_t(nVertices);
+        numTriangles = uint32_t(nIndices / 3);
+        vertices.reset(new Vector3f[nVertices]);
+        std::copy(v, v + nVertices, vertices.get());
+        stCoordinates.reset(new Vector2f[nVertices]);
+        std::copy(st, st + nVertices, stCoordinates.get());
+        vertexIndex.reset(new uint32_t[nIndices]);
+        std::copy(indices, indices + nIndices, vertexIndex.get());
+
+        bvh.reset(new BVHAccel({}, 2 * TrianglePacket::kWidth, splitMethod, TrianglePacket::kWidth));
+        bvh->wideNodes.assign(nodes, nodes + nNodes);
+        bvh->updateStackSize();
+        bvh->packets.assign(packets, packets + nPackets);
+        bvh->builtSAHCost = costs[0];
+        area = float(costs[1]);
+        bounding_box = bvh->WorldBound();
+        return true;
+    }
 
-        bounding_box = Bounds3(min_vert, max_vert);
+    void saveCache(const std::string& path, const MeshCache::Key& key) const
+    {
+        MeshCache cache;
+        const double costs[2] = {bvh->builtSAHCost, area};
+        cache.add(vertices.get(), numVertices);
+        cache.add(stCoordinates.get(), numVertices);
+        cache.add(vertexIndex.get(), 3 * size_t(numTriangles));
+        cache.add(bvh->wideNodes.data(), bvh->wideNodes.size());
+        cache.add(bvh->packets.data(), bvh->packets.size());
+        cache.add(costs, 2);
+        cache.save(path, kCacheVersion, key);
+    }
 
+    // [comment]
+    // Triangle objects are only needed to build the BVH, whose leaves then keep the
+    // faces as TrianglePackets, and to sample emissive meshes face by face; other
+    // meshes drop them once the BVH is built.
+    // [/comment]
+    void buildBVH()
+    {
+        std::vector<Triangle>().swap(triangles);
+        triangles.reserve(numTriangles);
+        area = 0;
+        for (uint32_t k = 0; k < numTriangles; ++k) {
+            triangles.emplace_back(vertices[vertexIndex[3 * k]], vertices[vertexIndex[3 * k + 1]],
+                                   vertices[vertexIndex[3 * k + 2]], m);
+            area += triangles.back().area;
+        }
         std::vector<Object*> ptrs;
-        for (auto& tri : triangles){
+        for (auto& tri : triangles)
             ptrs.push_back(&tri);
-            area += tri.area;
+        bvh.reset(new BVHAccel(ptrs, 2 * TrianglePacket::kWidth, splitMethod, TrianglePacket::kWidth));
+        bounding_box = bvh->WorldBound();
+
+        std::vector<uint32_t> faces;
+        for (auto object : bvh->primitives)
+            faces.push_back(uint32_t(static_cast<Triangle*>(object) - triangles.data()));
+        bvh->packTriangles(faces, vertices.get(), vertexIndex.get());
+        if (!hasEmit()) {
+            bvh->primitives.clear();
+            std::vector<Triangle>().swap(triangles);
         }
-        bvh = new BVHAccel(ptrs);
+        else
+            buildFaceTable();
     }
 
-    bool intersect(const Ray& ray) { return true; }
+    // Emissive meshes are sampled face by face, in proportion to the face areas
+    void buildFaceTable()
+    {
+        std::vector<float> weights(triangles.size());
+        for (size_t k = 0; k < triangles.size(); ++k)
+            weights[k] = triangles[k].area;
+        faceTable = AliasTable(weights);
+    }
 
-    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
+    // [comment]
+    // To be called after the vertices moved, the faces staying the same: the BVH is
+    // refit, or built again once refitting has degraded it too much. The Triangle objects
+    // of emissive meshes are updated in place, but the light table still has to be built
+    // again for their new areas (Scene::refitBVH does), and so that it picks up the new
+    // Triangle objects if the BVH was built again.
+    // [/comment]
+    void refit()
     {
-        bool intersect = false;
-        for (uint32_t k = 0; k < numTriangles; ++k) {
-            const Vector3f& v0 = vertices[vertexIndex[k * 3]];
-            const Vector3f& v1 = vertices[vertexIndex[k * 3 + 1]];
-            const Vector3f& v2 = vertices[vertexIndex[k * 3 + 2]];
-            float t, u, v;
-            if (rayTriangleIntersect(v0, v1, v2, ray.origin, ray.direction, t,
-                                     u, v) &&
-                t < tnear) {
-                tnear = t;
-                index = k;
-                intersect |= true;
+        if (hasEmit()) {
+            area = 0;
+            for (uint32_t k = 0; k < numTriangles; ++k) {
+                triangles[k] = Triangle(vertices[vertexIndex[3 * k]], vertices[vertexIndex[3 * k + 1]],
+                                        vertices[vertexIndex[3 * k + 2]], m);
+                area += triangles[k].area;
             }
+            buildFaceTable();
         }
+        if (bvh->refit(vertices.get(), vertexIndex.get()) > BVHAccel::kMaxRefitCostGrowth)
+            buildBVH();
+        else
+            bounding_box = bvh->WorldBound();
+    }
+
+    bool intersect(const Ray& ray) { return bvh && bvh->IntersectP(ray); }
 
-        return intersect;
+    // Closest face hit before tnear
+    bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
+    {
+        Ray clipped = ray;
+        clipped.t_max = std::min(ray.t_max, double(tnear));
+        return bvh && bvh->IntersectTriangles(clipped, tnear, index);
     }
 
     Bounds3 getBounds() { return bounding_box; }
@@ -186,18 +289,54 @@ public:
 
     Intersection getIntersection(Ray ray)
     {
-        Intersection intersec;
+        float t = std::numeric_limits<float>::infinity();
+        uint32_t index;
+        if (!intersect(ray, t, index))
+            return Intersection();
+        return hitAt(ray.origin, ray.direction, t, index);
+    }
 
-        if (bvh) {
-            intersec = bvh->Intersect(ray);
-        }
+    void getIntersections(RayPacket& packet, uint64_t mask, Intersection* hits)
+    {
+        uint32_t face[RayPacket::kMaxSize];
+        uint64_t hit = bvh ? bvh->IntersectTrianglesPacket(packet, mask, face) : 0;
+        for (int k = 0; k < packet.size; ++k)
+            if (hit >> k & 1)
+                hits[k] = hitAt(packet.origin(k), packet.direction(k), packet.tMax[k], face[k]);
+    }
+
+    // Intersection record of the hit of face index at distance t along the ray
+    Intersection hitAt(const Vector3f& origin, const Vector3f& direction, float t, uint32_t index)
+    {
+        Intersection intersec;
+        const Vector3f& v0 = vertices[vertexIndex[index * 3]];
+        const Vector3f& v1 = vertices[vertexIndex[index * 3 + 1]];
+        const Vector3f& v2 = vertices[vertexIndex[index * 3 + 2]];
+        intersec.happened = true;
+        intersec.distance = t;
+        intersec.coords = origin + direction * t;
+        intersec.normal = normalize(crossProduct(v1 - v0, v2 - v0));
+        intersec.m = m;
+        // emissive meshes are sampled face by face (see collectEmitters)
+        intersec.obj = triangles.empty() ? static_cast<Object*>(this) : &triangles[index];
 
         return intersec;
     }
     
+    // A point uniformly on the mesh: a face picked by its area, then a point on it. Only
+    // emissive meshes can be sampled; others give pdf 0.
     void Sample(Intersection &pos, float &pdf){
-        bvh->Sample(pos, pdf);
-        pos.emit = m->getEmission();
+        pdf = 0;
+        if (faceTable.empty())
+            return;
+        triangles[faceTable.sample(get_random_float())].Sample(pos, pdf);
+        pdf = 1.0f / area;
+    }
+    void collectEmitters(std::vector<Object*> &emitters){
+        if (!hasEmit())
+            return;
+        for (auto& tri : triangles)
+            emitters.push_back(&tri);
     }
     float getArea(){
         return area;
@@ -208,19 +347,26 @@ public:
 
     Bounds3 bounding_box;
     std::unique_ptr<Vector3f[]> vertices;
+    uint32_t numVertices;
     uint32_t numTriangles;
     std::unique_ptr<uint32_t[]> vertexIndex;
     std::unique_ptr<Vector2f[]> stCoordinates;
 
     std::vector<Triangle> triangles;
+    AliasTable faceTable; // emissive meshes only
 
-    BVHAccel* bvh;
+    std::unique_ptr<BVHAccel> bvh;
+    BVHAccel::SplitMethod splitMethod;
     float area;
 
     Material* m;
 };
 
-inline bool Triangle::intersect(const Ray& ray) { return true; }
+inline bool Triangle::intersect(const Ray& ray)
+{
+    double t;
+    return intersectDistance(ray, t);
+}
 inline bool Triangle::intersect(const Ray& ray, float& tnear,
                                 uint32_t& index) const
 {
@@ -229,32 +375,38 @@ inline bool Triangle::intersect(const Ray& ray, float& tnear,
 
 inline Bounds3 Triangle::getBounds() { return Union(Bounds3(v0, v1), v2); }
 
-inline Intersection Triangle::getIntersection(Ray ray)
+// Moller-Trumbore test against the front face, accepting hits in [0, ray.t_max].
+inline bool Triangle::intersectDistance(const Ray& ray, double& t) const
 {
-    Intersection inter;
-
     if (dotProduct(ray.direction, normal) > 0)
-        return inter;
-    double u, v, t_tmp = 0;
+        return false;
+    double u, v;
     Vector3f pvec = crossProduct(ray.direction, e2);
     double det = dotProduct(e1, pvec);
     if (fabs(det) < EPSILON)
-        return inter;
+        return false;
 
     double det_inv = 1. / det;
     Vector3f tvec = ray.origin - v0;
     u = dotProduct(tvec, pvec) * det_inv;
     if (u < 0 || u > 1)
-        return inter;
+        return false;
     Vector3f qvec = crossProduct(tvec, e1);
     v = dotProduct(ray.direction, qvec) * det_inv;
     if (v < 0 || u + v > 1)
-        return inter;
-    t_tmp = dotProduct(e2, qvec) * det_inv;
-    if (t_tmp < 0)
+        return false;
+    t = dotProduct(e2, qvec) * det_inv;
+    return t >= 0 && t <= ray.t_max;
+}
+
+inline Intersection Triangle::getIntersection(Ray ray)
+{
+    Intersection inter;
+
+    double t_tmp;
+    if (!intersectDistance(ray, t_tmp))
         return inter;
 
-    // TODO find ray triangle intersection
     inter.happened = true;
     inter.distance = t_tmp;
     inter.coords = ray(t_tmp);
@@ -0,0 +1,80 @@
+#pragma once
+#include <cstdint>
+#include "Ray.hpp"
+#include "Vector.hpp"
+#include "global.hpp"
+
+// [comment]
+// kWidth triangles stored as structure of arrays (first vertex and the two edges), the
+// compact form in which the leaves of a mesh BVH keep their triangles: 40 bytes per
+// triangle instead of a Triangle object reached through a pointer. The loops run the
+// Moller-Trumbore test on all lanes at once; unused lanes have zero edges and never hit.
+// [/comment]
+struct alignas(16) TrianglePacket
+{
+    static constexpr int kWidth = 4;
+
+    float v0x[kWidth] = {}, v0y[kWidth] = {}, v0z[kWidth] = {};
+    float e1x[kWidth] = {}, e1y[kWidth] = {}, e1z[kWidth] = {};
+    float e2x[kWidth] = {}, e2y[kWidth] = {}, e2z[kWidth] = {};
+    uint32_t id[kWidth] = {};
+
+    void set(int lane, const Vector3f& v0, const Vector3f& v1, const Vector3f& v2, uint32_t face)
+    {
+        const Vector3f e1 = v1 - v0, e2 = v2 - v0;
+        v0x[lane] = v0.x, v0y[lane] = v0.y, v0z[lane] = v0.z;
+        e1x[lane] = e1.x, e1y[lane] = e1.y, e1z[lane] = e1.z;
+        e2x[lane] = e2.x, e2y[lane] = e2.y, e2z[lane] = e2.z;
+        id[lane] = face;
+    }
+
+    // Distances of the front-facing hits in [0, tMax] (-1 for the other lanes)
+    void distances(const Vector3f& origin, const Vector3f& direction, float tMax, float t[kWidth]) const
+    {
+        const float ox = origin.x, oy = origin.y, oz = origin.z;
+        const float dx = direction.x, dy = direction.y, dz = direction.z;
+        #pragma omp simd
+        for (int i = 0; i < kWidth; ++i) {
+            float px = dy * e2z[i] - dz * e2y[i];
+            float py = dz * e2x[i] - dx * e2z[i];
+            float pz = dx * e2y[i] - dy * e2x[i];
+            float det = e1x[i] * px + e1y[i] * py + e1z[i] * pz;
+            float sx = ox - v0x[i], sy = oy - v0y[i], sz = oz - v0z[i];
+            float u = sx * px + sy * py + sz * pz;
+            float qx = sy * e1z[i] - sz * e1y[i];
+            float qy = sz * e1x[i] - sx * e1z[i];
+            float qz = sx * e1y[i] - sy * e1x[i];
+            float v = dx * qx + dy * qy + dz * qz;
+            float d = (e2x[i] * qx + e2y[i] * qy + e2z[i] * qz) / det;
+            // det > 0: front face; u and v are still scaled by det
+            bool hit = det > EPSILON && u >= 0 && v >= 0 && u + v <= det && d >= 0 && d <= tMax;
+            t[i] = hit ? d : -1.f;
+        }
+    }
+
+    // Closest hit with t in [0, tMax]: returns its lane and lowers tMax to it, or -1
+    int intersect(const Vector3f& origin, const Vector3f& direction, float& tMax) const
+    {
+        float t[kWidth];
+        distances(origin, direction, tMax, t);
+        int lane = -1;
+        for (int i = 0; i < kWidth; ++i)
+            if (t[i] >= 0 && t[i] <= tMax) {
+                tMax = t[i];
+                lane = i;
+            }
+        return lane;
+    }
+
+    int intersect(const Ray& ray, float& tMax) const { return intersect(ray.origin, ray.direction, tMax); }
+
+    bool occluded(const Ray& ray, float tMax) const
+    {
+        float t[kWidth];
+        distances(ray.origin, ray.direction, tMax, t);
+        bool any = false;
+        for (int i = 0; i < kWidth; ++i)
+            any |= t[i] >= 0;
+        return any;
+    }
+};
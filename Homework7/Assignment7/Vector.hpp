@@ -8,7 +8,53 @@
 #include <iostream>
 #include <cmath>
 #include <algorithm>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define RAYTRACING_SIMD_VECTOR 1
+#else
+#define RAYTRACING_SIMD_VECTOR 0
+#endif
+
+// [comment]
+// With SSE2, a Vector3f is 16 byte aligned and loaded as one SSE register (simd()): x, y
+// and z in the low lanes and a fourth lane w that the constructors set to 0 and that
+// nothing reads, so the arithmetic is one instruction per operator. It does the same
+// float operations in the same order as the scalar version (dotProduct adds x, y, z left
+// to right, Min and Max return the same operand on ties), so both give bit-identical
+// results. The price is memory: 16 bytes per vector instead of 12.
+// [/comment]
+#if RAYTRACING_SIMD_VECTOR
+class alignas(16) Vector3f {
+public:
+    float x, y, z, w;
+    Vector3f() : x(0), y(0), z(0), w(0) {}
+    Vector3f(float xx) : x(xx), y(xx), z(xx), w(0) {}
+    Vector3f(float xx, float yy, float zz) : x(xx), y(yy), z(zz), w(0) {}
+    explicit Vector3f(__m128 m) { _mm_store_ps(&x, m); }
+    __m128 simd() const { return _mm_load_ps(&x); }
+    Vector3f operator * (const float &r) const { return Vector3f(_mm_mul_ps(simd(), _mm_set1_ps(r))); }
+    Vector3f operator / (const float &r) const { return Vector3f(_mm_div_ps(simd(), _mm_set1_ps(r))); }
+
+    float norm();
+    Vector3f normalized() { return *this / norm(); }
+
+    Vector3f operator * (const Vector3f &v) const { return Vector3f(_mm_mul_ps(simd(), v.simd())); }
+    Vector3f operator - (const Vector3f &v) const { return Vector3f(_mm_sub_ps(simd(), v.simd())); }
+    Vector3f operator + (const Vector3f &v) const { return Vector3f(_mm_add_ps(simd(), v.simd())); }
+    Vector3f operator - () const { return Vector3f(_mm_xor_ps(simd(), _mm_set1_ps(-0.f))); }
+    Vector3f& operator += (const Vector3f &v) { _mm_store_ps(&x, _mm_add_ps(simd(), v.simd())); return *this; }
+    friend Vector3f operator * (const float &r, const Vector3f &v)
+    { return Vector3f(_mm_mul_ps(v.simd(), _mm_set1_ps(r))); }
+    friend std::ostream & operator << (std::ostream &os, const Vector3f &v)
+    { return os << v.x << ", " << v.y << ", " << v.z; }
+    double       operator[](int index) const;
+    double&      operator[](int index);
 
+    // std::min(a, b) is b < a ? b : a, and _mm_min_ps(b, a) the same
+    static Vector3f Min(const Vector3f &p1, const Vector3f &p2) { return Vector3f(_mm_min_ps(p2.simd(), p1.simd())); }
+    static Vector3f Max(const Vector3f &p1, const Vector3f &p2) { return Vector3f(_mm_max_ps(p2.simd(), p1.simd())); }
+};
+#else
 class Vector3f {
 public:
     float x, y, z;
@@ -47,6 +93,7 @@ public:
                        std::max(p1.z, p2.z));
     }
 };
+#endif
 inline double Vector3f::operator[](int index) const {
     return (&x)[index];
 }
@@ -66,17 +113,25 @@ public:
 inline Vector3f lerp(const Vector3f &a, const Vector3f& b, const float &t)
 { return a * (1 - t) + b * t; }
 
-inline Vector3f normalize(const Vector3f &v)
+#if RAYTRACING_SIMD_VECTOR
+inline float dotProduct(const Vector3f &a, const Vector3f &b)
 {
-    float mag2 = v.x * v.x + v.y * v.y + v.z * v.z;
-    if (mag2 > 0) {
-        float invMag = 1 / sqrtf(mag2);
-        return Vector3f(v.x * invMag, v.y * invMag, v.z * invMag);
-    }
+    __m128 p = _mm_mul_ps(a.simd(), b.simd());
+    __m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)), z = _mm_movehl_ps(p, p);
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(p, y), z));
+}
 
-    return v;
+// a.yzx * b.zxy - a.zxy * b.yzx
+inline Vector3f crossProduct(const Vector3f &a, const Vector3f &b)
+{
+    __m128 va = a.simd(), vb = b.simd();
+    __m128 a1 = _mm_shuffle_ps(va, va, _MM_SHUFFLE(3, 0, 2, 1)), b1 = _mm_shuffle_ps(vb, vb, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 a2 = _mm_shuffle_ps(va, va, _MM_SHUFFLE(3, 1, 0, 2)), b2 = _mm_shuffle_ps(vb, vb, _MM_SHUFFLE(3, 0, 2, 1));
+    return Vector3f(_mm_sub_ps(_mm_mul_ps(a1, b1), _mm_mul_ps(a2, b2)));
 }
 
+inline float Vector3f::norm() { return std::sqrt(dotProduct(*this, *this)); }
+#else
 inline float dotProduct(const Vector3f &a, const Vector3f &b)
 { return a.x * b.x + a.y * b.y + a.z * b.z; }
 
@@ -88,6 +143,18 @@ inline Vector3f crossProduct(const Vector3f &a, const Vector3f &b)
             a.x * b.y - a.y * b.x
     );
 }
+#endif
+
+inline Vector3f normalize(const Vector3f &v)
+{
+    float mag2 = dotProduct(v, v);
+    if (mag2 > 0) {
+        float invMag = 1 / sqrtf(mag2);
+        return v * invMag;
+    }
+
+    return v;
+}
 
 
 
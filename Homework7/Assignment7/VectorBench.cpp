@@ -0,0 +1,91 @@
+// [comment]
+// Microbenchmark of Vector3f and Bounds3, for comparing the SSE and the scalar versions:
+// shading style vector math, ray-box tests and BVH build style bounds updates over 4096
+// random elements, each timed as the best of 7 runs. The checksums are printed so that
+// both versions can be seen to compute the same values.
+//
+//     cmake --build build --target VectorBench && build/VectorBench
+//     (scalar: configure a second build with -DCMAKE_CXX_FLAGS=-U__SSE2__)
+// [/comment]
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "Bounds3.hpp"
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main()
+{
+    const int N = 4096, runs = 7;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    std::vector<Vector3f> a(N), b(N), c(N), out(N);
+    for (int i = 0; i < N; ++i) {
+        a[i] = Vector3f(u(rng), u(rng), u(rng));
+        b[i] = Vector3f(u(rng), u(rng), u(rng));
+        c[i] = Vector3f(u(rng), u(rng), u(rng));
+    }
+    printf("sizeof(Vector3f) %zu, sizeof(Bounds3) %zu\n", sizeof(Vector3f), sizeof(Bounds3));
+
+    double best = 1e9, check = 0;
+    for (int run = 0; run < runs; ++run) {
+        double start = now();
+        float sum = 0;
+        for (int it = 0; it < 200; ++it)
+            for (int i = 0; i < N; ++i) {
+                Vector3f n = normalize(crossProduct(a[i], b[i]) + c[i] * 0.5f);
+                out[i] = lerp(n, a[i], 0.25f) - b[i] * c[i];
+                sum += dotProduct(out[i], a[i]);
+            }
+        best = std::min(best, now() - start);
+        check = sum;
+    }
+    printf("vector math   %7.1f M/s  (check %.3f)\n", 200.0 * N / best / 1e6, check);
+
+    std::vector<Bounds3> boxes(N);
+    for (int i = 0; i < N; ++i) {
+        Vector3f p = a[i] * 4.f;
+        Vector3f size(0.5f + 2.f * std::abs(b[i].x), 0.5f + 2.f * std::abs(b[i].y), 0.5f + 2.f * std::abs(b[i].z));
+        boxes[i] = Bounds3(p, p + size);
+    }
+    std::vector<Ray> rays;
+    for (int i = 0; i < 64; ++i)
+        rays.emplace_back(c[i] * 2.f, normalize(a[i + 100]));
+    best = 1e9;
+    long hits = 0;
+    for (int run = 0; run < runs; ++run) {
+        double start = now();
+        long h = 0;
+        for (int it = 0; it < 4; ++it)
+            for (const Ray& r : rays) {
+                std::array<int, 3> dirIsNeg = {int(r.direction.x < 0), int(r.direction.y < 0), int(r.direction.z < 0)};
+                for (int i = 0; i < N; ++i)
+                    h += boxes[i].IntersectP(r, r.direction_inv, dirIsNeg, 10.f);
+            }
+        best = std::min(best, now() - start);
+        hits = h;
+    }
+    printf("box tests     %7.1f M/s  (hits %ld)\n", 4.0 * rays.size() * N / best / 1e6, hits);
+
+    best = 1e9;
+    for (int run = 0; run < runs; ++run) {
+        double start = now(), sum = 0;
+        for (int it = 0; it < 100; ++it) {
+            Bounds3 bounds, centroidBounds;
+            for (int i = 0; i < N; ++i) {
+                bounds = Union(bounds, boxes[i]);
+                centroidBounds = Union(centroidBounds, boxes[i].Centroid());
+                sum += bounds.SurfaceArea() * 1e-6 + centroidBounds.Diagonal().x;
+            }
+        }
+        best = std::min(best, now() - start);
+        check = sum;
+    }
+    printf("bounds build  %7.1f M/s  (check %.3f)\n", 100.0 * N / best / 1e6, check);
+    return 0;
+}
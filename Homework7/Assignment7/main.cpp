@@ -1,3 +1,4 @@
+#include "Instance.hpp"
 #include "Renderer.hpp"
 #include "Scene.hpp"
 #include "Triangle.hpp"
@@ -5,6 +6,7 @@
 #include "Vector.hpp"
 #include "global.hpp"
 #include <chrono>
+#include <cstdlib>
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
@@ -32,16 +34,71 @@ int main(int argc, char** argv)
     MeshTriangle right("../Assignment7/models/cornellbox/right.obj", green);
     MeshTriangle light_("../Assignment7/models/cornellbox/light.obj", light);
 
-    scene.Add(&floor);
-    scene.Add(&shortbox);
-    scene.Add(&tallbox);
-    scene.Add(&left);
-    scene.Add(&right);
-    scene.Add(&light_);
+    // usage: RayTracing [output] [random|stratified|halton] [--spp N] [--time seconds]
+    //                   [--preview passes] [--checkpoint file] [--adaptive threshold]
+    //                   [--wavefront] [--sort-rays] [--no-packets] [--denoise] [--aux]
+    //                   [--instances]
+    // --instances places the meshes through instances (with the identity transform)
+    Renderer r;
+    bool instances = false;
+    int positional = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--spp" && hasValue)
+            r.spp = std::atoi(argv[++i]);
+        else if (arg == "--time" && hasValue)
+            r.timeBudget = std::atof(argv[++i]);
+        else if (arg == "--preview" && hasValue)
+            r.previewInterval = std::atoi(argv[++i]);
+        else if (arg == "--checkpoint" && hasValue)
+            r.checkpointFile = argv[++i];
+        else if (arg == "--adaptive" && hasValue)
+            r.adaptiveThreshold = std::atof(argv[++i]);
+        else if (arg == "--wavefront")
+            r.wavefront = true;
+        else if (arg == "--sort-rays")
+            r.sortRays = true;
+        else if (arg == "--no-packets")
+            r.packets = false;
+        else if (arg == "--denoise")
+            r.denoise = true;
+        else if (arg == "--aux")
+            r.writeAux = true;
+        else if (arg == "--instances")
+            instances = true;
+        else if (arg.compare(0, 2, "--") != 0 && positional == 0) {
+            r.outputFile = arg;
+            ++positional;
+        }
+        else if (arg.compare(0, 2, "--") != 0 && positional == 1) {
+            if (arg == "stratified")
+                r.sampleMode = SampleMode::Stratified;
+            else if (arg == "halton")
+                r.sampleMode = SampleMode::Halton;
+            else if (arg != "random") {
+                std::cerr << "Unknown sampler " << arg << ", expected random, stratified or halton\n";
+                return 1;
+            }
+            ++positional;
+        }
+        else {
+            std::cerr << "Unknown argument " << arg << "\n";
+            return 1;
+        }
+    }
 
-    scene.buildBVH();
+    std::vector<std::unique_ptr<Instance>> placed;
+    for (MeshTriangle* mesh : {&floor, &shortbox, &tallbox, &left, &right, &light_}) {
+        if (instances) {
+            placed.emplace_back(new Instance(mesh, Transform()));
+            scene.Add(placed.back().get());
+        }
+        else
+            scene.Add(mesh);
+    }
 
-    Renderer r;
+    scene.buildBVH();
 
     auto start = std::chrono::system_clock::now();
     r.Render(scene);